@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#else
+#define HAVE_CYCLES 0
+#endif
+
+#include "label.h"
+#include "render.h"
+
+const char usage[] =
+	"Usage: river-tag-overlay-bench [options...]\n"
+	"   --time        <int>    Minimum time per case in milliseconds\n"
+	"   --baseline    <file>   Compare against earlier results\n"
+	"   --threshold   <int>    Allowed slowdown against the baseline in percent\n"
+	"   --kernel      <name>   Span fill kernel: avx2, sse2 or scalar\n"
+	"   --font        <name>   Font of the tag labels, or none (default monospace)\n"
+	"\n"
+	"Prints one line per case: name, ns/frame, cycles/pixel, pixels written/frame.\n"
+	"Cases prefixed with pixman/ use the pixman atlas renderer, cases prefixed\n"
+	"with labels/ draw tag labels and fail if a glyph is rendered while timing.\n"
+	"They are skipped if no font is given and the default one is not found.\n"
+	"\n";
+
+#define NSEC_PER_SEC 1000000000
+#define ROUNDS 5
+
+struct Config
+{
+	const char *name;
+	uint32_t border_width;
+	uint32_t square_size;
+	uint32_t square_padding;
+	uint32_t square_border_width;
+	uint32_t square_inner_padding;
+};
+
+static const struct Config configs[] = {
+	{ "default", 2, 40, 15, 1, 10 },
+	{ "compact", 1, 20,  5, 1,  4 },
+	{ "thick",   6, 80, 20, 4, 20 },
+};
+
+static const uint32_t tag_amounts[] = { 1, 4, 9, 16, 32 };
+
+/* In 120ths, like the scales the pop-up is rendered at. */
+static const uint32_t scales[] = { 120, 180, 240, 360, 480 };
+
+enum Mode
+{
+	/* Background and every square, as for a fresh buffer. */
+	MODE_FULL,
+
+	/* Focus moving one tag over, redrawing two squares. */
+	MODE_UPDATE,
+};
+
+enum Renderer
+{
+	RENDERER_SPANS,
+	RENDERER_PIXMAN,
+};
+
+struct Result
+{
+	char name[96];
+	double ns_per_frame;
+	double cycles_per_pixel;
+	double pixels_per_frame;
+};
+
+uint64_t min_time = 50000000;
+
+static uint64_t now_nsec (void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t cycles (void)
+{
+#if HAVE_CYCLES
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void state (struct Tags *tags, uint32_t frame)
+{
+	const uint32_t tag = frame % tag_amount;
+	tags->focused = 1u << tag;
+	tags->view = 0x55555555u;
+	tags->urgent = 0x00000100u;
+}
+
+static bool draw (enum Renderer renderer, pixman_image_t *image, struct Atlas *atlas,
+		uint32_t scale, struct Tags *tags, struct Tags *drawn)
+{
+	if ( renderer != RENDERER_PIXMAN )
+		return draw_frame(image, scale, tags, drawn);
+	draw_frame_pixman(image, atlas, tags, drawn);
+	return true;
+}
+
+static pixman_image_t *create_image (uint32_t scale, pixman_format_code_t format)
+{
+	return pixman_image_create_bits(format,
+			(int32_t)scale_length(surface_width, scale),
+			(int32_t)scale_length(surface_height, scale), NULL, 0);
+}
+
+/* Checks that both renderers produce the same pixels for a full frame
+ * followed by a run of updates.
+ */
+static bool verify_case (uint32_t scale, pixman_format_code_t format)
+{
+	struct Atlas *atlas = get_atlas(scale);
+	if ( atlas == NULL )
+		return false;
+
+	pixman_image_t *images[2] = { create_image(scale, format), create_image(scale, format) };
+	bool ret = images[0] != NULL && images[1] != NULL;
+	const size_t bytes = ret ? (size_t)pixman_image_get_stride(images[0])
+		* (size_t)pixman_image_get_height(images[0]) : 0;
+
+	struct Tags tags, drawn;
+	for (uint32_t frame = 0; ret && frame <= 2 * tag_amount; frame++)
+	{
+		state(&tags, frame);
+		for (int i = 0; ret && i < 2; i++)
+			ret = draw((enum Renderer)i, images[i], atlas, scale, &tags, frame == 0 ? NULL : &drawn);
+		drawn = tags;
+		if ( ret && memcmp(pixman_image_get_data(images[0]), pixman_image_get_data(images[1]), bytes) != 0 )
+			ret = false;
+	}
+
+	for (int i = 0; i < 2; i++)
+		if ( images[i] != NULL )
+			pixman_image_unref(images[i]);
+	return ret;
+}
+
+static bool run_case (struct Result *result, enum Renderer renderer, enum Mode mode, uint32_t scale)
+{
+	struct Atlas *atlas = get_atlas(scale);
+	if ( atlas == NULL )
+		return false;
+
+	pixman_image_t *image = create_image(scale, PIXMAN_a8r8g8b8);
+	if ( image == NULL )
+		return false;
+
+	struct Tags tags, drawn;
+	state(&drawn, 0);
+	if (! draw(renderer, image, atlas, scale, &drawn, NULL) )
+	{
+		pixman_image_unref(image);
+		return false;
+	}
+
+	/* Everything the frames need is prepared by now. */
+	const uint64_t start_glyphs = glyphs_rasterized;
+
+	/* Frames are timed in batches, so reading the clock does not show up
+	 * in the results. Of several rounds the fastest is reported, which is
+	 * the least disturbed by the rest of the system.
+	 */
+	const double pixels = (double)pixman_image_get_width(image)
+		* (double)pixman_image_get_height(image);
+	result->ns_per_frame = 0.0;
+	result->cycles_per_pixel = 0.0;
+	result->pixels_per_frame = 0.0;
+	uint32_t frame = 0;
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		uint64_t frames = 0, elapsed = 0, elapsed_cycles = 0;
+		uint32_t batch = 16;
+		const uint64_t start_pixels = pixels_written;
+		while ( elapsed < min_time / ROUNDS )
+		{
+			const uint64_t start = now_nsec();
+			const uint64_t start_cycles = cycles();
+			for (uint32_t i = 0; i < batch; i++, frames++)
+			{
+				state(&tags, ++frame);
+				draw(renderer, image, atlas, scale, &tags,
+						mode == MODE_FULL ? NULL : &drawn);
+				drawn = tags;
+			}
+			elapsed_cycles += cycles() - start_cycles;
+			elapsed += now_nsec() - start;
+			if ( batch < 65536 )
+				batch *= 2;
+		}
+
+		const double ns_per_frame = (double)elapsed / (double)frames;
+		if ( round == 0 || ns_per_frame < result->ns_per_frame )
+		{
+			result->ns_per_frame = ns_per_frame;
+			result->cycles_per_pixel = (double)elapsed_cycles / (double)frames / pixels;
+			result->pixels_per_frame = (double)(pixels_written - start_pixels) / (double)frames;
+		}
+	}
+
+	pixman_image_unref(image);
+	if ( glyphs_rasterized != start_glyphs )
+	{
+		fprintf(stderr, "ERROR: %lu glyphs were rendered while timing.\n",
+				(unsigned long)(glyphs_rasterized - start_glyphs));
+		return false;
+	}
+	return true;
+}
+
+static struct Result *read_baseline (const char *path, size_t *amount)
+{
+	FILE *file = fopen(path, "r");
+	if ( file == NULL )
+	{
+		fprintf(stderr, "ERROR: fopen: %s: %s.\n", path, strerror(errno));
+		return NULL;
+	}
+
+	struct Result *results = NULL;
+	size_t capacity = 0;
+	*amount = 0;
+
+	char line[256];
+	while ( fgets(line, sizeof(line), file) != NULL )
+	{
+		if ( line[0] == '#' )
+			continue;
+
+		if ( *amount == capacity )
+		{
+			capacity = capacity == 0 ? 256 : 2 * capacity;
+			struct Result *tmp = realloc(results, capacity * sizeof(struct Result));
+			if ( tmp == NULL )
+			{
+				fprintf(stderr, "ERROR: realloc: %s.\n", strerror(errno));
+				free(results);
+				fclose(file);
+				return NULL;
+			}
+			results = tmp;
+		}
+
+		struct Result *result = &results[*amount];
+		if ( 3 == sscanf(line, "%95s %lf %lf", result->name,
+					&result->ns_per_frame, &result->cycles_per_pixel) )
+			(*amount)++;
+	}
+
+	fclose(file);
+	return results;
+}
+
+static struct Result *find_result (struct Result *results, size_t amount, const char *name)
+{
+	for (size_t i = 0; i < amount; i++)
+		if ( strcmp(results[i].name, name) == 0 )
+			return &results[i];
+	return NULL;
+}
+
+int main (int argc, char *argv[])
+{
+	enum
+	{
+		TIME,
+		BASELINE,
+		THRESHOLD,
+		KERNEL,
+		FONT,
+	};
+
+	static struct option opts[] = {
+		{ "help",      no_argument,       NULL, 'h'       },
+		{ "time",      required_argument, NULL, TIME      },
+		{ "baseline",  required_argument, NULL, BASELINE  },
+		{ "threshold", required_argument, NULL, THRESHOLD },
+		{ "kernel",    required_argument, NULL, KERNEL    },
+		{ "font",      required_argument, NULL, FONT      },
+		{ NULL,        0,                 NULL, 0         },
+	};
+
+	const char *baseline_path = NULL;
+	double threshold = 10.0;
+	const char *font_name = "monospace";
+	bool font_given = false;
+
+	int opt;
+	while ( (opt = getopt_long(argc, argv, "h", opts, NULL)) != -1 ) switch (opt)
+	{
+		case 'h':
+			fputs(usage, stderr);
+			return EXIT_SUCCESS;
+
+		case TIME:
+			if ( atoi(optarg) < 1 )
+			{
+				fputs("ERROR: Time per case must be at least 1 ms.\n", stderr);
+				return EXIT_FAILURE;
+			}
+			min_time = (uint64_t)atoi(optarg) * 1000000;
+			break;
+
+		case BASELINE:
+			baseline_path = optarg;
+			break;
+
+		case THRESHOLD:
+			threshold = atof(optarg);
+			break;
+
+		case KERNEL:
+			if (! select_span_kernel(optarg))
+			{
+				fprintf(stderr, "ERROR: Span kernel '%s' is not available.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case FONT:
+			font_name = optarg;
+			font_given = true;
+			break;
+
+		default:
+			return EXIT_FAILURE;
+	}
+
+	struct Result *baseline = NULL;
+	size_t baseline_amount = 0;
+	if ( baseline_path != NULL )
+	{
+		baseline = read_baseline(baseline_path, &baseline_amount);
+		if ( baseline == NULL )
+			return EXIT_FAILURE;
+	}
+
+	default_colours();
+	wl_list_init(&atlases);
+	wl_list_init(&layouts);
+	wl_list_init(&label_atlases);
+
+	/* One short label for every tag. */
+	uint32_t label_amount = 0;
+	if ( strcmp(font_name, "none") != 0 )
+	{
+		char labels[32 * 3] = "";
+		for (uint32_t i = 0; i < 32; i++)
+			snprintf(labels + strlen(labels), sizeof(labels) - strlen(labels),
+					i == 0 ? "%u" : ":%u", i + 1);
+		if (! parse_tag_labels(labels) )
+		{
+			free(baseline);
+			return EXIT_FAILURE;
+		}
+		if ( load_font(font_name) )
+			label_amount = tag_label_amount;
+		else if ( font_given )
+		{
+			finish_font();
+			free(baseline);
+			return EXIT_FAILURE;
+		}
+		else
+		{
+			/* Machines without fonts can still time the squares. */
+			fputs("Skipping the cases with labels, pick a font with --font.\n", stderr);
+			finish_font();
+		}
+	}
+
+	printf("# case ns/frame cycles/pixel pixels/frame%s, %s span kernel\n",
+			HAVE_CYCLES ? "" : " (no cycle counter)", span_kernel_name());
+
+	int ret = EXIT_SUCCESS;
+	uint32_t regressions = 0;
+	for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+	{
+		border_width         = configs[c].border_width;
+		square_size          = configs[c].square_size;
+		square_padding       = configs[c].square_padding;
+		square_border_width  = configs[c].square_border_width;
+		square_inner_padding = configs[c].square_inner_padding;
+
+		/* Atlases and layouts depend on the sizes. */
+		destroy_atlases();
+		destroy_layouts();
+		destroy_label_atlases();
+
+		for (size_t t = 0; t < sizeof(tag_amounts) / sizeof(tag_amounts[0]); t++)
+		{
+			tag_amount = tag_amounts[t];
+			compute_surface_size();
+
+			for (size_t s = 0; s < sizeof(scales) / sizeof(scales[0]); s++)
+			for (uint32_t labelled = 0; labelled <= (label_amount > 0 ? 1 : 0); labelled++)
+			{
+				tag_label_amount = labelled ? label_amount : 0;
+				if (! verify_case(scales[s], PIXMAN_a8r8g8b8)
+						|| ! verify_case(scales[s], PIXMAN_r5g6b5) )
+				{
+					fprintf(stderr, "ERROR: Span renderer differs from pixman for %s%s/tags=%u/scale=%u.%02u.\n",
+							labelled ? "labels/" : "", configs[c].name, tag_amount,
+							scales[s] / 120, scales[s] % 120 * 100 / 120);
+					ret = EXIT_FAILURE;
+					goto out;
+				}
+
+				/* Labels are drawn the same way by both renderers. */
+				for (int renderer = RENDERER_SPANS; renderer <= (labelled ? RENDERER_SPANS : RENDERER_PIXMAN); renderer++)
+				for (int mode = MODE_FULL; mode <= MODE_UPDATE; mode++)
+				{
+					struct Result result;
+					snprintf(result.name, sizeof(result.name), "%s%s%s/%s/tags=%u/scale=%u.%02u",
+							labelled ? "labels/" : "",
+							renderer == RENDERER_PIXMAN ? "pixman/" : "",
+							mode == MODE_FULL ? "full" : "update", configs[c].name,
+							tag_amount, scales[s] / 120, scales[s] % 120 * 100 / 120);
+
+					if (! run_case(&result, (enum Renderer)renderer, (enum Mode)mode, scales[s]))
+					{
+						fprintf(stderr, "ERROR: Failed to run %s.\n", result.name);
+						ret = EXIT_FAILURE;
+						goto out;
+					}
+
+					printf("%s %.1f %.3f %.0f\n", result.name, result.ns_per_frame,
+							result.cycles_per_pixel, result.pixels_per_frame);
+					fflush(stdout);
+
+					struct Result *base = find_result(baseline, baseline_amount, result.name);
+					if ( base == NULL )
+						continue;
+					const double change = 100.0 * (result.ns_per_frame / base->ns_per_frame - 1.0);
+					if ( change > threshold )
+					{
+						fprintf(stderr, "REGRESSION: %s: %.1f ns/frame, was %.1f (%+.1f%%).\n",
+								result.name, result.ns_per_frame, base->ns_per_frame, change);
+						regressions++;
+					}
+				}
+			}
+		}
+	}
+
+	if ( baseline != NULL )
+	{
+		fprintf(stderr, "%u regressions against %s.\n", regressions, baseline_path);
+		if ( regressions > 0 )
+			ret = EXIT_FAILURE;
+	}
+
+out:
+	destroy_atlases();
+	destroy_layouts();
+	destroy_label_atlases();
+	finish_font();
+	free(baseline);
+	return ret;
+}
@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# Draws every case of check/cases with the pixman atlas renderer and with
+# the span renderer on every span kernel the CPU supports, both as full
+# frames and as updates of other tags, and compares each image byte for
+# byte with the reference image of the case.
+#
+# Usage: check.sh [--update] path/to/river-tag-overlay
+#
+# With --update the reference images are drawn anew with the reference
+# renderer instead, which fills every part of every square on its own and
+# shares no code with the atlas or the spans.
+
+update=false
+if [ "$1" = "--update" ]
+then
+	update=true
+	shift
+fi
+binary="${1:-./river-tag-overlay}"
+dir="$(dirname "$0")"
+
+# Small squares keep the reference images small.
+geometry="--border-width 1 --square-size 12 --square-padding 3 --square-inner-padding 3 --square-border-width 1"
+
+# Tags the frames are drawn as updates of: all squares changed, a mix, and
+# none changed for the tags of most cases.
+froms="0:0:0 0xffffffff:0:0xffffffff 0x4:0x1f5:0x100"
+
+tmp="$(mktemp -d)" || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+kernels=""
+for kernel in avx2 sse2 scalar
+do
+	if "$binary" --span-kernel "$kernel" --render-to "$tmp/probe.pam" 2>/dev/null
+	then
+		kernels="$kernels $kernel"
+	else
+		echo "Skipping span kernel $kernel, the CPU does not support it."
+	fi
+done
+
+cases=0
+failed=0
+while read -r name options
+do
+	case "$name" in
+		""|"#"*) continue ;;
+	esac
+	reference="$dir/$name.pam"
+
+	if $update
+	then
+		"$binary" $geometry $options --renderer reference --render-to "$reference" || exit 1
+		cases=$((cases + 1))
+		continue
+	fi
+
+	if [ ! -f "$reference" ]
+	then
+		echo "FAIL $name: no reference image, run make check-references."
+		failed=$((failed + 1))
+		continue
+	fi
+
+	for renderer in pixman $kernels
+	do
+		if [ "$renderer" = "pixman" ]
+		then
+			args="--renderer pixman"
+		else
+			args="--renderer spans --span-kernel $renderer"
+		fi
+
+		for from in "" $froms
+		do
+			label="$renderer"
+			extra=""
+			if [ -n "$from" ]
+			then
+				label="$renderer --render-from $from"
+				extra="--render-from $from"
+			fi
+
+			cases=$((cases + 1))
+			if ! "$binary" $geometry $options $args $extra --render-to "$tmp/$name.pam"
+			then
+				echo "FAIL $name ($label): can not draw."
+				failed=$((failed + 1))
+			elif ! cmp -s "$reference" "$tmp/$name.pam"
+			then
+				echo "FAIL $name ($label): differs from $reference."
+				failed=$((failed + 1))
+			fi
+		done
+	done
+done < "$dir/cases"
+
+if $update
+then
+	echo "Drew $cases reference images."
+	exit 0
+fi
+
+echo "$((cases - failed)) of $cases images match their reference."
+[ "$failed" -eq 0 ]
@@ -0,0 +1,224 @@
+#include <stdbool.h>
+#include <time.h>
+
+#include "flight.h"
+
+/* Spans are named after their begin event. */
+static const char *const type_names[FLIGHT_TYPE_AMOUNT] = {
+	[FLIGHT_FOCUSED_TAGS]     = "focused_tags",
+	[FLIGHT_VIEW_TAGS]        = "view_tags",
+	[FLIGHT_URGENT_TAGS]      = "urgent_tags",
+	[FLIGHT_FOCUSED_OUTPUT]   = "focused_output",
+	[FLIGHT_UNFOCUSED_OUTPUT] = "unfocused_output",
+	[FLIGHT_UPDATE_SURFACE]   = "update_surface",
+	[FLIGHT_RENDER_BEGIN]     = "render_frame",
+	[FLIGHT_NEXT_BUFFER]      = "next_buffer",
+	[FLIGHT_COMMIT]           = "commit",
+	[FLIGHT_BUFFER_RELEASE]   = "buffer_release",
+	[FLIGHT_CONFIGURE]        = "configure",
+	[FLIGHT_SURFACE_DESTROY]  = "surface_destroy",
+	[FLIGHT_POLL_BEGIN]       = "poll",
+	[FLIGHT_JOBS_BEGIN]       = "draw_jobs",
+};
+
+static const char *const buffer_names[] = {
+	[FLIGHT_BUFFER_SHARED]   = "shared",
+	[FLIGHT_BUFFER_FREE]     = "free",
+	[FLIGHT_BUFFER_RESCALED] = "rescaled",
+	[FLIGHT_BUFFER_CREATED]  = "created",
+	[FLIGHT_BUFFER_NONE]     = "none",
+};
+
+/* Track names are written for this many outputs; events of any others
+ * still show up, on tracks without a name. Spans are paired up on this
+ * many tracks.
+ */
+#define NAMED_OUTPUT_MAX 64
+
+void flight_record (struct Flight_recorder *recorder, enum Flight_type type,
+		uint32_t output, uint32_t arg0, uint32_t arg1)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	struct Flight_event *event = &recorder->events[recorder->count++ & (FLIGHT_EVENT_AMOUNT - 1)];
+	event->time = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+	event->type = (uint32_t)type;
+	event->output = output;
+	event->args[0] = arg0;
+	event->args[1] = arg1;
+}
+
+static struct Flight_event *get_event (struct Flight_recorder *recorder, uint64_t index)
+{
+	return &recorder->events[index & (FLIGHT_EVENT_AMOUNT - 1)];
+}
+
+/* Kinds of spans, by their begin and end event. */
+#define SPAN_KIND_AMOUNT 3
+
+/* Returns the kind of span of a begin or end event, or -1 for any other
+ * event.
+ */
+static int span_kind (uint32_t type)
+{
+	switch (type)
+	{
+		case FLIGHT_RENDER_BEGIN:
+		case FLIGHT_RENDER_END:
+			return 0;
+
+		case FLIGHT_POLL_BEGIN:
+		case FLIGHT_POLL_END:
+			return 1;
+
+		case FLIGHT_JOBS_BEGIN:
+		case FLIGHT_JOBS_END:
+			return 2;
+
+		default:
+			return -1;
+	}
+}
+
+static bool is_begin (uint32_t type)
+{
+	return type == FLIGHT_RENDER_BEGIN || type == FLIGHT_POLL_BEGIN || type == FLIGHT_JOBS_BEGIN;
+}
+
+/* Chrome traces count in microseconds; fractions keep the nanoseconds. */
+static void write_time (FILE *file, const char *key, uint64_t nsec)
+{
+	fprintf(file, ",\"%s\":%lu.%03lu", key, (unsigned long)(nsec / 1000),
+			(unsigned long)(nsec % 1000));
+}
+
+static void write_args (FILE *file, struct Flight_event *event, struct Flight_event *end)
+{
+	switch (event->type)
+	{
+		case FLIGHT_FOCUSED_TAGS:
+		case FLIGHT_VIEW_TAGS:
+		case FLIGHT_URGENT_TAGS:
+			fprintf(file, ",\"args\":{\"tags\":\"0x%08x\"}", event->args[0]);
+			break;
+
+		case FLIGHT_RENDER_BEGIN:
+			fprintf(file, ",\"args\":{\"rendered\":%s}", end->args[0] ? "true" : "false");
+			break;
+
+		case FLIGHT_NEXT_BUFFER:
+			fprintf(file, ",\"args\":{\"outcome\":\"%s\"", buffer_names[event->args[0]]);
+			if ( event->args[0] != FLIGHT_BUFFER_NONE )
+				fprintf(file, ",\"buffer\":%u", event->args[1]);
+			fputc('}', file);
+			break;
+
+		case FLIGHT_BUFFER_RELEASE:
+			fprintf(file, ",\"args\":{\"buffer\":%u}", event->args[0]);
+			break;
+
+		case FLIGHT_CONFIGURE:
+			fprintf(file, ",\"args\":{\"width\":%u,\"height\":%u}",
+					event->args[0], event->args[1]);
+			break;
+
+		case FLIGHT_JOBS_BEGIN:
+			fprintf(file, ",\"args\":{\"jobs\":%u}", event->args[0]);
+			break;
+	}
+}
+
+/* Writes a span from its begin to its end, or an instant event if end is
+ * NULL.
+ */
+static void write_event (FILE *file, pid_t pid, struct Flight_event *event, struct Flight_event *end)
+{
+	fprintf(file, ",{\"name\":\"%s\",\"pid\":%d,\"tid\":%u",
+			type_names[event->type], (int)pid, event->output);
+	write_time(file, "ts", event->time);
+	if ( end != NULL )
+	{
+		fputs(",\"ph\":\"X\"", file);
+		write_time(file, "dur", end->time - event->time);
+	}
+	else
+		fputs(",\"ph\":\"i\",\"s\":\"t\"", file);
+	write_args(file, event, end);
+	fputc('}', file);
+}
+
+/* Writes the recorded events as a Chrome trace, which Perfetto and
+ * chrome://tracing load. Events of the main loop are on one track and
+ * those of every output on a track of its own. Spans become complete
+ * events, written when their end is reached; an end whose begin was
+ * overwritten and a begin whose end is not recorded yet are left out.
+ */
+void flight_write_json (struct Flight_recorder *recorder, FILE *file, pid_t pid)
+{
+	const uint64_t first = recorder->count > FLIGHT_EVENT_AMOUNT
+		? recorder->count - FLIGHT_EVENT_AMOUNT : 0;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":["
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+			"\"args\":{\"name\":\"river-tag-overlay\"}},"
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+			"\"args\":{\"name\":\"main loop\"}}",
+			(int)pid, (int)pid);
+
+	uint32_t named[NAMED_OUTPUT_MAX];
+	size_t named_amount = 0;
+	for (uint64_t i = first; i < recorder->count; i++)
+	{
+		const uint32_t output = get_event(recorder, i)->output;
+		bool found = output == 0;
+		for (size_t j = 0; j < named_amount && ! found; j++)
+			found = named[j] == output;
+		if ( found || named_amount == NAMED_OUTPUT_MAX )
+			continue;
+		named[named_amount++] = output;
+		fprintf(file, ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+				"\"args\":{\"name\":\"output %u\"}}",
+				(int)pid, output, output);
+	}
+
+	/* Spans do not nest with themselves, so every track has at most one
+	 * open span of each kind. The begins of those are kept until their
+	 * end comes up.
+	 */
+	struct Flight_event *open[SPAN_KIND_AMOUNT][NAMED_OUTPUT_MAX];
+	size_t open_amount[SPAN_KIND_AMOUNT] = { 0 };
+	for (uint64_t i = first; i < recorder->count; i++)
+	{
+		struct Flight_event *event = get_event(recorder, i);
+		const int kind = span_kind(event->type);
+		if ( kind < 0 )
+		{
+			write_event(file, pid, event, NULL);
+			continue;
+		}
+
+		struct Flight_event **begins = open[kind];
+		size_t *amount = &open_amount[kind];
+		size_t j = *amount;
+		while ( j > 0 && begins[j - 1]->output != event->output )
+			j--;
+
+		if ( is_begin(event->type) )
+		{
+			/* A begin still open on the track never got its end. */
+			if ( j > 0 )
+				begins[j - 1] = event;
+			else if ( *amount < NAMED_OUTPUT_MAX )
+				begins[(*amount)++] = event;
+			continue;
+		}
+
+		if ( j == 0 )
+			continue;
+		write_event(file, pid, begins[j - 1], event);
+		begins[j - 1] = begins[--(*amount)];
+	}
+
+	fputs("]}\n", file);
+}
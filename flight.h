@@ -0,0 +1,90 @@
+#ifndef RIVER_TAG_OVERLAY_FLIGHT_H
+#define RIVER_TAG_OVERLAY_FLIGHT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Amount of events kept; older ones are overwritten. A power of two. */
+#define FLIGHT_EVENT_AMOUNT 8192
+
+/* Types of events. Spans are recorded as a begin event followed by the end
+ * event, which comes right after it in this enum.
+ */
+enum Flight_type
+{
+	/* The first argument is the new tags. */
+	FLIGHT_FOCUSED_TAGS,
+	FLIGHT_VIEW_TAGS,
+	FLIGHT_URGENT_TAGS,
+
+	FLIGHT_FOCUSED_OUTPUT,
+	FLIGHT_UNFOCUSED_OUTPUT,
+	FLIGHT_UPDATE_SURFACE,
+
+	/* The first argument of the end is whether a frame was rendered. */
+	FLIGHT_RENDER_BEGIN,
+	FLIGHT_RENDER_END,
+
+	/* The first argument is a Flight_buffer, the second the buffer id. */
+	FLIGHT_NEXT_BUFFER,
+
+	FLIGHT_COMMIT,
+
+	/* The first argument is the buffer id. */
+	FLIGHT_BUFFER_RELEASE,
+
+	/* The arguments are the width and height. */
+	FLIGHT_CONFIGURE,
+
+	FLIGHT_SURFACE_DESTROY,
+
+	/* From going to sleep in poll() until waking up. */
+	FLIGHT_POLL_BEGIN,
+	FLIGHT_POLL_END,
+
+	/* Workers drawing frames; the first argument is the amount. */
+	FLIGHT_JOBS_BEGIN,
+	FLIGHT_JOBS_END,
+
+	FLIGHT_TYPE_AMOUNT,
+};
+
+/* Where the buffer of a frame came from. */
+enum Flight_buffer
+{
+	FLIGHT_BUFFER_SHARED,
+	FLIGHT_BUFFER_FREE,
+	FLIGHT_BUFFER_RESCALED,
+	FLIGHT_BUFFER_CREATED,
+	FLIGHT_BUFFER_NONE,
+};
+
+struct Flight_event
+{
+	/* Monotonic time in nanoseconds. */
+	uint64_t time;
+	uint32_t type;
+
+	/* Global name of the output, or 0 for the main loop. */
+	uint32_t output;
+
+	uint32_t args[2];
+};
+
+/* Ring of the last events, kept so the timeline of a slow pop-up can be
+ * looked at after the fact. Recording takes a clock read and a store, and
+ * nothing is recorded while idle. Not thread-safe.
+ */
+struct Flight_recorder
+{
+	/* Amount of events ever recorded. */
+	uint64_t count;
+	struct Flight_event events[FLIGHT_EVENT_AMOUNT];
+};
+
+void flight_record (struct Flight_recorder *recorder, enum Flight_type type,
+		uint32_t output, uint32_t arg0, uint32_t arg1);
+void flight_write_json (struct Flight_recorder *recorder, FILE *file, pid_t pid);
+
+#endif
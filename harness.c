@@ -0,0 +1,1580 @@
+#include <errno.h>
+#include <getopt.h>
+#include <linux/sockios.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server.h>
+
+#include "river-status-unstable-v1-server.h"
+#include "single-pixel-buffer-v1-server.h"
+#include "trace.h"
+#include "viewporter-server.h"
+#include "wlr-layer-shell-unstable-v1-server.h"
+
+/* A stand-in compositor implementing just enough of wl_compositor, wl_shm,
+ * zwlr_layer_shell_v1 and zriver_status_manager_v1 to drive
+ * river-tag-overlay with scripted tag events, or a trace recorded with
+ * river-tag-overlay --record, and measure how long it takes from an event
+ * being sent until the resulting wl_surface.commit.
+ */
+
+const char usage[] =
+	"Usage: river-tag-overlay-harness [options...] -- river-tag-overlay [options...]\n"
+	"   --events    <int>   Amount of scripted tag events (default 200)\n"
+	"   --interval  <int>   Milliseconds between tag events (default 50)\n"
+	"   --outputs   <int>   Amount of outputs (default 1)\n"
+	"   --refresh   <int>   Simulated refresh period in milliseconds (default 16)\n"
+	"   --scale     <int>   Output scale (default 1)\n"
+	"   --hold      <int>   Refresh periods replaced buffers are held before release (default 0)\n"
+	"   --checksums         Print a checksum of every committed buffer to stderr\n"
+	"   --replay    <path>  Send the events of a trace instead of scripted ones\n"
+	"   --fast              Replay as fast as the client reads the events\n"
+	"   --subsurfaces       Offer wl_subcompositor, wp_viewporter and wp_single_pixel_buffer_v1\n"
+	"   --mirror            Send every scripted tag event to all outputs\n"
+	"   --rate      <int>   Send scripted tag events at this rate per second (1 to 10000)\n"
+	"                       to at most 8 outputs, and report the cost per event\n"
+	"\n"
+	"Prints the results as a single JSON object.\n"
+	"\n";
+
+struct Buffer_ref
+{
+	struct wl_resource *resource;
+	struct wl_listener destroy;
+};
+
+struct Output
+{
+	struct wl_list link;
+	struct wl_global *global;
+	struct wl_list resources;
+	struct wl_list status_resources;
+	uint32_t index;
+	uint32_t focused_tags, view_tags, urgent_tags;
+	int32_t scale;
+
+	/* Global name of the output in the replayed trace. */
+	uint32_t trace_name;
+
+	/* Time the last scripted event for this output was sent. Zero if no
+	 * commit is outstanding.
+	 */
+	uint64_t event_sent;
+	uint32_t requests_at_event;
+};
+
+struct Surface
+{
+	struct wl_resource *resource;
+	struct wl_resource *layer_surface;
+	struct Output *output;
+	struct Buffer_ref pending, current;
+	bool attached;
+	struct wl_list pending_frames;
+	bool initialized, mapped;
+
+	/* Whether an opaque region is set; its extent is not checked. */
+	bool opaque;
+
+	/* Copy of the surface contents, only updated where damage was
+	 * reported, to verify the damage of every commit.
+	 */
+	uint8_t *texture;
+	int32_t texture_width, texture_height, texture_bpp;
+	struct wl_array damage;
+};
+
+struct wl_display *wl_display = NULL;
+struct wl_event_loop *loop = NULL;
+struct wl_list outputs;
+struct wl_list frame_callbacks;
+struct wl_list seat_status_resources;
+struct wl_event_source *event_timer = NULL;
+struct wl_event_source *refresh_timer = NULL;
+pid_t child = -1;
+struct wl_client *client = NULL;
+int client_fd = -1;
+bool client_alive = true;
+bool print_checksums = false;
+bool offer_subsurfaces = false;
+bool mirror_outputs = false;
+
+uint32_t event_amount = 200;
+uint32_t event_interval = 50;
+uint32_t output_amount = 1;
+uint32_t refresh_period = 16;
+int32_t output_scale = 1;
+
+uint32_t events_sent = 0;
+uint64_t *latencies = NULL;
+uint32_t latency_count = 0;
+uint64_t requests = 0;
+uint64_t commits = 0;
+uint64_t buffers_created = 0;
+uint64_t popup_requests = 0;
+uint64_t damage_errors = 0;
+uint64_t opaque_commits = 0;
+uint64_t client_cpu_nsec = 0;
+uint64_t client_peak_rss = 0;
+int ret = EXIT_SUCCESS;
+
+static uint64_t now_nsec (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+/************
+ *          *
+ *  Buffer  *
+ *          *
+ ************/
+static void buffer_ref_handle_destroy (struct wl_listener *listener, void *data)
+{
+	struct Buffer_ref *ref = wl_container_of(listener, ref, destroy);
+	ref->resource = NULL;
+	wl_list_remove(&ref->destroy.link);
+	wl_list_init(&ref->destroy.link);
+}
+
+static void buffer_ref_set (struct Buffer_ref *ref, struct wl_resource *resource)
+{
+	wl_list_remove(&ref->destroy.link);
+	wl_list_init(&ref->destroy.link);
+	ref->resource = resource;
+	if ( resource != NULL )
+		wl_resource_add_destroy_listener(resource, &ref->destroy);
+}
+
+static void buffer_ref_init (struct Buffer_ref *ref)
+{
+	ref->resource = NULL;
+	ref->destroy.notify = buffer_ref_handle_destroy;
+	wl_list_init(&ref->destroy.link);
+}
+
+/* Replaced buffers held back for hold_frames refresh cycles. */
+#define HELD_MAX 32
+struct Held
+{
+	struct Buffer_ref ref;
+	uint64_t release_tick;
+} held[HELD_MAX];
+uint32_t hold_frames = 0;
+uint64_t tick = 0;
+
+static void release_buffer (struct wl_resource *resource)
+{
+	if ( hold_frames == 0 )
+	{
+		wl_buffer_send_release(resource);
+		return;
+	}
+	for (int i = 0; i < HELD_MAX; i++)
+		if ( held[i].ref.resource == NULL )
+		{
+			if ( held[i].ref.destroy.notify == NULL )
+				buffer_ref_init(&held[i].ref);
+			buffer_ref_set(&held[i].ref, resource);
+			held[i].release_tick = tick + hold_frames;
+			return;
+		}
+	wl_buffer_send_release(resource);
+}
+
+static void release_held_buffers (void)
+{
+	for (int i = 0; i < HELD_MAX; i++)
+		if ( held[i].ref.resource != NULL && held[i].release_tick <= tick )
+		{
+			wl_buffer_send_release(held[i].ref.resource);
+			buffer_ref_set(&held[i].ref, NULL);
+		}
+}
+
+/*************
+ *           *
+ *  Surface  *
+ *           *
+ *************/
+static void resource_handle_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void unlink_resource (struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void surface_handle_attach (struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *buffer, int32_t x, int32_t y)
+{
+	struct Surface *surface = wl_resource_get_user_data(resource);
+	buffer_ref_set(&surface->pending, buffer);
+	surface->attached = true;
+}
+
+static void surface_handle_damage (struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) { }
+
+static void surface_handle_frame (struct wl_client *client, struct wl_resource *resource,
+		uint32_t id)
+{
+	struct Surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback = wl_resource_create(client, &wl_callback_interface, 1, id);
+	if ( callback == NULL )
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(callback, NULL, NULL, unlink_resource);
+	wl_list_insert(surface->pending_frames.prev, wl_resource_get_link(callback));
+}
+
+static void surface_handle_set_region (struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *region) { }
+
+static void surface_handle_set_opaque_region (struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *region)
+{
+	struct Surface *surface = wl_resource_get_user_data(resource);
+	surface->opaque = region != NULL;
+}
+
+static void configure_layer_surface (struct Surface *surface)
+{
+	zwlr_layer_surface_v1_send_configure(surface->layer_surface,
+			wl_display_next_serial(wl_display), 0, 0);
+}
+
+static void surface_handle_damage_buffer (struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct Surface *surface = wl_resource_get_user_data(resource);
+	int32_t *rect = wl_array_add(&surface->damage, 4 * sizeof(int32_t));
+	if ( rect == NULL )
+		return;
+	rect[0] = x, rect[1] = y, rect[2] = width, rect[3] = height;
+}
+
+static int32_t clamp (int32_t v, int32_t min, int32_t max)
+{
+	return v < min ? min : v > max ? max : v;
+}
+
+static int32_t pixel_size (struct wl_shm_buffer *shm_buffer)
+{
+	return wl_shm_buffer_get_format(shm_buffer) == WL_SHM_FORMAT_RGB565 ? 2 : 4;
+}
+
+/* Applies the damage of a commit to the texture and counts the pixels in
+ * which the texture then differs from the buffer.
+ */
+static void verify_damage (struct Surface *surface)
+{
+	struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get(surface->current.resource);
+	if ( shm_buffer == NULL )
+		return;
+
+	const int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+	const int32_t width = wl_shm_buffer_get_width(shm_buffer);
+	const int32_t height = wl_shm_buffer_get_height(shm_buffer);
+	const int32_t bpp = pixel_size(shm_buffer);
+	if ( surface->texture_width != width || surface->texture_height != height
+			|| surface->texture_bpp != bpp )
+	{
+		free(surface->texture);
+		surface->texture = calloc((size_t)(width * height), (size_t)bpp);
+		surface->texture_bpp = bpp;
+		surface->texture_width = width;
+		surface->texture_height = height;
+		if ( surface->texture == NULL )
+			return;
+	}
+
+	wl_shm_buffer_begin_access(shm_buffer);
+	const uint8_t *data = wl_shm_buffer_get_data(shm_buffer);
+	int32_t *rect;
+	for (rect = surface->damage.data;
+			(const char *)rect < (const char *)surface->damage.data + surface->damage.size;
+			rect += 4)
+	{
+		const int32_t x1 = clamp(rect[0], 0, width), x2 = clamp(rect[0] + rect[2], 0, width);
+		const int32_t y1 = clamp(rect[1], 0, height), y2 = clamp(rect[1] + rect[3], 0, height);
+		for (int32_t y = y1; y < y2 && x1 < x2; y++)
+			memcpy(&surface->texture[(y * width + x1) * bpp], &data[y * stride + x1 * bpp],
+					(size_t)((x2 - x1) * bpp));
+	}
+	uint64_t bad = 0;
+	for (int32_t y = 0; y < height; y++)
+		if ( memcmp(&surface->texture[y * width * bpp], &data[y * stride], (size_t)(width * bpp)) != 0 )
+			bad++;
+	wl_shm_buffer_end_access(shm_buffer);
+
+	if ( bad > 0 )
+	{
+		damage_errors++;
+		fprintf(stderr, "Damage error: %lu rows differ.\n", (unsigned long)bad);
+	}
+}
+
+static void surface_handle_commit (struct wl_client *client, struct wl_resource *resource)
+{
+	struct Surface *surface = wl_resource_get_user_data(resource);
+	commits++;
+
+	if ( surface->attached )
+	{
+		/* The shm contents are "uploaded" on commit, so the previous
+		 * buffer is released once it is replaced.
+		 */
+		if ( surface->current.resource != NULL
+				&& surface->current.resource != surface->pending.resource )
+			release_buffer(surface->current.resource);
+		buffer_ref_set(&surface->current, surface->pending.resource);
+		buffer_ref_set(&surface->pending, NULL);
+		surface->attached = false;
+	}
+
+	wl_list_insert_list(frame_callbacks.prev, &surface->pending_frames);
+	wl_list_init(&surface->pending_frames);
+
+	if ( surface->layer_surface == NULL )
+		return;
+
+	if ( surface->current.resource == NULL )
+	{
+		if ( surface->mapped )
+		{
+			/* Unmap commit. */
+			surface->mapped = false;
+			surface->initialized = false;
+		}
+		else if (! surface->initialized)
+		{
+			surface->initialized = true;
+			configure_layer_surface(surface);
+		}
+		return;
+	}
+
+	surface->mapped = true;
+	if ( surface->opaque )
+		opaque_commits++;
+	verify_damage(surface);
+	surface->damage.size = 0;
+
+	if ( print_checksums )
+	{
+		struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get(surface->current.resource);
+		if ( shm_buffer != NULL )
+		{
+			wl_shm_buffer_begin_access(shm_buffer);
+			const uint8_t *data = wl_shm_buffer_get_data(shm_buffer);
+			const int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+			const int32_t width = wl_shm_buffer_get_width(shm_buffer);
+			const int32_t height = wl_shm_buffer_get_height(shm_buffer);
+			uint64_t hash = 14695981039346656037UL;
+			for (int32_t y = 0; y < height; y++)
+				for (int32_t x = 0; x < width * pixel_size(shm_buffer); x++)
+					hash = (hash ^ data[y * stride + x]) * 1099511628211UL;
+			wl_shm_buffer_end_access(shm_buffer);
+			fprintf(stderr, "commit %u %dx%d %016lx\n",
+					surface->output == NULL ? 0 : surface->output->index,
+					width, height, (unsigned long)hash);
+		}
+	}
+
+	struct Output *output = surface->output;
+	if ( output != NULL && output->event_sent != 0 )
+	{
+		latencies[latency_count++] = now_nsec() - output->event_sent;
+		popup_requests += requests - output->requests_at_event;
+		output->event_sent = 0;
+	}
+}
+
+static void surface_handle_set_int (struct wl_client *client, struct wl_resource *resource,
+		int32_t value) { }
+
+static void surface_handle_offset (struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y) { }
+
+static const struct wl_surface_interface surface_implementation = {
+	.destroy              = resource_handle_destroy,
+	.attach               = surface_handle_attach,
+	.damage               = surface_handle_damage,
+	.frame                = surface_handle_frame,
+	.set_opaque_region    = surface_handle_set_opaque_region,
+	.set_input_region     = surface_handle_set_region,
+	.commit               = surface_handle_commit,
+	.set_buffer_transform = surface_handle_set_int,
+	.set_buffer_scale     = surface_handle_set_int,
+	.damage_buffer        = surface_handle_damage_buffer,
+	.offset               = surface_handle_offset,
+};
+
+static void surface_handle_resource_destroy (struct wl_resource *resource)
+{
+	struct Surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback, *tmp;
+	wl_resource_for_each_safe(callback, tmp, &surface->pending_frames)
+		wl_resource_destroy(callback);
+	buffer_ref_set(&surface->pending, NULL);
+	buffer_ref_set(&surface->current, NULL);
+	wl_array_release(&surface->damage);
+	free(surface->texture);
+	if ( surface->layer_surface != NULL )
+		wl_resource_set_user_data(surface->layer_surface, NULL);
+	free(surface);
+}
+
+static void region_handle_rect (struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) { }
+
+static const struct wl_region_interface region_implementation = {
+	.destroy  = resource_handle_destroy,
+	.add      = region_handle_rect,
+	.subtract = region_handle_rect,
+};
+
+static void compositor_handle_create_surface (struct wl_client *client, struct wl_resource *resource,
+		uint32_t id)
+{
+	struct Surface *surface = calloc(1, sizeof(struct Surface));
+	if ( surface == NULL )
+	{
+		wl_client_post_no_memory(client);
+		return;
+	}
+	surface->resource = wl_resource_create(client, &wl_surface_interface,
+			wl_resource_get_version(resource), id);
+	buffer_ref_init(&surface->pending);
+	buffer_ref_init(&surface->current);
+	wl_list_init(&surface->pending_frames);
+	wl_array_init(&surface->damage);
+	wl_resource_set_implementation(surface->resource, &surface_implementation,
+			surface, surface_handle_resource_destroy);
+}
+
+static void compositor_handle_create_region (struct wl_client *client, struct wl_resource *resource,
+		uint32_t id)
+{
+	struct wl_resource *region = wl_resource_create(client, &wl_region_interface, 1, id);
+	wl_resource_set_implementation(region, &region_implementation, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_implementation = {
+	.create_surface = compositor_handle_create_surface,
+	.create_region  = compositor_handle_create_region,
+};
+
+static void bind_compositor (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_compositor_interface,
+			(int)version, id);
+	wl_resource_set_implementation(resource, &compositor_implementation, NULL, NULL);
+}
+
+/****************
+ *              *
+ *  Subsurface  *
+ *              *
+ ****************/
+/* Subsurfaces, viewports and single pixel buffers are accepted but have no
+ * effect; only their requests are counted.
+ */
+static void subsurface_handle_set_position (struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y) { }
+
+static void subsurface_handle_place (struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *sibling) { }
+
+static void subsurface_handle_set_mode (struct wl_client *client, struct wl_resource *resource) { }
+
+static const struct wl_subsurface_interface subsurface_implementation = {
+	.destroy      = resource_handle_destroy,
+	.set_position = subsurface_handle_set_position,
+	.place_above  = subsurface_handle_place,
+	.place_below  = subsurface_handle_place,
+	.set_sync     = subsurface_handle_set_mode,
+	.set_desync   = subsurface_handle_set_mode,
+};
+
+static void subcompositor_handle_get_subsurface (struct wl_client *client, struct wl_resource *resource,
+		uint32_t id, struct wl_resource *surface, struct wl_resource *parent)
+{
+	struct wl_resource *subsurface = wl_resource_create(client, &wl_subsurface_interface, 1, id);
+	wl_resource_set_implementation(subsurface, &subsurface_implementation, NULL, NULL);
+}
+
+static const struct wl_subcompositor_interface subcompositor_implementation = {
+	.destroy        = resource_handle_destroy,
+	.get_subsurface = subcompositor_handle_get_subsurface,
+};
+
+static void bind_subcompositor (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_subcompositor_interface,
+			(int)version, id);
+	wl_resource_set_implementation(resource, &subcompositor_implementation, NULL, NULL);
+}
+
+static void viewport_handle_set_source (struct wl_client *client, struct wl_resource *resource,
+		wl_fixed_t x, wl_fixed_t y, wl_fixed_t width, wl_fixed_t height) { }
+
+static void viewport_handle_set_destination (struct wl_client *client, struct wl_resource *resource,
+		int32_t width, int32_t height) { }
+
+static const struct wp_viewport_interface viewport_implementation = {
+	.destroy         = resource_handle_destroy,
+	.set_source      = viewport_handle_set_source,
+	.set_destination = viewport_handle_set_destination,
+};
+
+static void viewporter_handle_get_viewport (struct wl_client *client, struct wl_resource *resource,
+		uint32_t id, struct wl_resource *surface)
+{
+	struct wl_resource *viewport = wl_resource_create(client, &wp_viewport_interface, 1, id);
+	wl_resource_set_implementation(viewport, &viewport_implementation, NULL, NULL);
+}
+
+static const struct wp_viewporter_interface viewporter_implementation = {
+	.destroy      = resource_handle_destroy,
+	.get_viewport = viewporter_handle_get_viewport,
+};
+
+static void bind_viewporter (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wp_viewporter_interface,
+			(int)version, id);
+	wl_resource_set_implementation(resource, &viewporter_implementation, NULL, NULL);
+}
+
+static const struct wl_buffer_interface single_pixel_buffer_implementation = {
+	.destroy = resource_handle_destroy,
+};
+
+static void single_pixel_buffer_manager_handle_create (struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+{
+	struct wl_resource *buffer = wl_resource_create(client, &wl_buffer_interface, 1, id);
+	wl_resource_set_implementation(buffer, &single_pixel_buffer_implementation, NULL, NULL);
+}
+
+static const struct wp_single_pixel_buffer_manager_v1_interface single_pixel_buffer_manager_implementation = {
+	.destroy                = resource_handle_destroy,
+	.create_u32_rgba_buffer = single_pixel_buffer_manager_handle_create,
+};
+
+static void bind_single_pixel_buffer_manager (struct wl_client *client, void *data,
+		uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client,
+			&wp_single_pixel_buffer_manager_v1_interface, (int)version, id);
+	wl_resource_set_implementation(resource, &single_pixel_buffer_manager_implementation,
+			NULL, NULL);
+}
+
+/*******************
+ *                 *
+ *  Layer surface  *
+ *                 *
+ *******************/
+static void layer_surface_handle_set_size (struct wl_client *client, struct wl_resource *resource,
+		uint32_t width, uint32_t height) { }
+
+static void layer_surface_handle_set_uint (struct wl_client *client, struct wl_resource *resource,
+		uint32_t value) { }
+
+static void layer_surface_handle_set_exclusive_zone (struct wl_client *client, struct wl_resource *resource,
+		int32_t zone) { }
+
+static void layer_surface_handle_set_margin (struct wl_client *client, struct wl_resource *resource,
+		int32_t top, int32_t right, int32_t bottom, int32_t left) { }
+
+static void layer_surface_handle_get_popup (struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *popup) { }
+
+static void layer_surface_handle_ack_configure (struct wl_client *client, struct wl_resource *resource,
+		uint32_t serial) { }
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_implementation = {
+	.set_size                   = layer_surface_handle_set_size,
+	.set_anchor                 = layer_surface_handle_set_uint,
+	.set_exclusive_zone         = layer_surface_handle_set_exclusive_zone,
+	.set_margin                 = layer_surface_handle_set_margin,
+	.set_keyboard_interactivity = layer_surface_handle_set_uint,
+	.get_popup                  = layer_surface_handle_get_popup,
+	.ack_configure              = layer_surface_handle_ack_configure,
+	.destroy                    = resource_handle_destroy,
+};
+
+static void layer_surface_handle_resource_destroy (struct wl_resource *resource)
+{
+	struct Surface *surface = wl_resource_get_user_data(resource);
+	if ( surface != NULL )
+		surface->layer_surface = NULL;
+}
+
+static struct Output *output_from_resource (struct wl_resource *resource)
+{
+	return resource == NULL ? NULL : wl_resource_get_user_data(resource);
+}
+
+static void layer_shell_handle_get_layer_surface (struct wl_client *client, struct wl_resource *resource,
+		uint32_t id, struct wl_resource *wl_surface, struct wl_resource *wl_output,
+		uint32_t layer, const char *namespace)
+{
+	struct Surface *surface = wl_resource_get_user_data(wl_surface);
+	surface->output = output_from_resource(wl_output);
+	surface->layer_surface = wl_resource_create(client, &zwlr_layer_surface_v1_interface,
+			wl_resource_get_version(resource), id);
+	wl_resource_set_implementation(surface->layer_surface, &layer_surface_implementation,
+			surface, layer_surface_handle_resource_destroy);
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_implementation = {
+	.get_layer_surface = layer_shell_handle_get_layer_surface,
+};
+
+static void bind_layer_shell (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &zwlr_layer_shell_v1_interface,
+			(int)version, id);
+	wl_resource_set_implementation(resource, &layer_shell_implementation, NULL, NULL);
+}
+
+/************
+ *          *
+ *  Output  *
+ *          *
+ ************/
+static const struct wl_output_interface output_implementation = {
+	.release = resource_handle_destroy,
+};
+
+static void bind_output (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct Output *output = (struct Output *)data;
+	struct wl_resource *resource = wl_resource_create(client, &wl_output_interface,
+			(int)version, id);
+	wl_resource_set_implementation(resource, &output_implementation, output, unlink_resource);
+	wl_list_insert(&output->resources, wl_resource_get_link(resource));
+
+	wl_output_send_geometry(resource, 0, 0, 0, 0, 0, "harness", "harness", 0);
+	wl_output_send_mode(resource, 1, 1920, 1080, 60000);
+	if ( version >= WL_OUTPUT_SCALE_SINCE_VERSION )
+		wl_output_send_scale(resource, output->scale);
+	if ( version >= WL_OUTPUT_DONE_SINCE_VERSION )
+		wl_output_send_done(resource);
+}
+
+static struct wl_resource *output_resource (struct Output *output, struct wl_client *client)
+{
+	struct wl_resource *resource;
+	wl_resource_for_each(resource, &output->resources)
+		if ( wl_resource_get_client(resource) == client )
+			return resource;
+	return NULL;
+}
+
+static void send_output_status (struct wl_resource *resource, struct Output *output)
+{
+	zriver_output_status_v1_send_focused_tags(resource, output->focused_tags);
+
+	struct wl_array view_tags;
+	wl_array_init(&view_tags);
+	uint32_t *tags = wl_array_add(&view_tags, sizeof(uint32_t));
+	if ( tags != NULL )
+		*tags = output->view_tags;
+	zriver_output_status_v1_send_view_tags(resource, &view_tags);
+	wl_array_release(&view_tags);
+
+	if ( wl_resource_get_version(resource) >= ZRIVER_OUTPUT_STATUS_V1_URGENT_TAGS_SINCE_VERSION )
+		zriver_output_status_v1_send_urgent_tags(resource, output->urgent_tags);
+}
+
+static struct Output *create_output (uint32_t index)
+{
+	struct Output *output = calloc(1, sizeof(struct Output));
+	if ( output == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
+		return NULL;
+	}
+	output->index = index;
+	output->scale = output_scale;
+	wl_list_init(&output->resources);
+	wl_list_init(&output->status_resources);
+	output->global = wl_global_create(wl_display, &wl_output_interface, 3, output, bind_output);
+	wl_list_insert(outputs.prev, &output->link);
+	return output;
+}
+
+/******************
+ *                *
+ *  River status  *
+ *                *
+ ******************/
+/* Output focused by the seat, only tracked when replaying. */
+struct Output *focused_output = NULL;
+
+static void send_focused_output (struct wl_resource *resource)
+{
+	if ( focused_output == NULL )
+		return;
+	struct wl_resource *output = output_resource(focused_output, wl_resource_get_client(resource));
+	if ( output != NULL )
+		zriver_seat_status_v1_send_focused_output(resource, output);
+}
+
+static const struct zriver_output_status_v1_interface output_status_implementation = {
+	.destroy = resource_handle_destroy,
+};
+
+static const struct zriver_seat_status_v1_interface seat_status_implementation = {
+	.destroy = resource_handle_destroy,
+};
+
+static void status_manager_handle_get_river_output_status (struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *wl_output)
+{
+	struct Output *output = output_from_resource(wl_output);
+	struct wl_resource *status = wl_resource_create(client, &zriver_output_status_v1_interface,
+			wl_resource_get_version(resource), id);
+	wl_resource_set_implementation(status, &output_status_implementation, output, unlink_resource);
+	wl_list_insert(&output->status_resources, wl_resource_get_link(status));
+	send_output_status(status, output);
+}
+
+static void status_manager_handle_get_river_seat_status (struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *seat)
+{
+	struct wl_resource *status = wl_resource_create(client, &zriver_seat_status_v1_interface,
+			1, id);
+	wl_resource_set_implementation(status, &seat_status_implementation, NULL, unlink_resource);
+	wl_list_insert(&seat_status_resources, wl_resource_get_link(status));
+	send_focused_output(status);
+}
+
+static const struct zriver_status_manager_v1_interface status_manager_implementation = {
+	.destroy                 = resource_handle_destroy,
+	.get_river_output_status = status_manager_handle_get_river_output_status,
+	.get_river_seat_status   = status_manager_handle_get_river_seat_status,
+};
+
+static void bind_status_manager (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &zriver_status_manager_v1_interface,
+			(int)version, id);
+	wl_resource_set_implementation(resource, &status_manager_implementation, NULL, NULL);
+}
+
+static const struct wl_seat_interface seat_implementation = {
+	.release = resource_handle_destroy,
+};
+
+static void bind_seat (struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_seat_interface,
+			(int)version, id);
+	wl_resource_set_implementation(resource, &seat_implementation, NULL, NULL);
+	wl_seat_send_capabilities(resource, 0);
+}
+
+/************
+ *          *
+ *  Replay  *
+ *          *
+ ************/
+/* Starts measuring the latency until the next commit of the output's
+ * pop-up. If the previous event of this output has not been committed yet,
+ * its latency is measured up to the commit for this one.
+ */
+static void mark_event (struct Output *output)
+{
+	if ( output->event_sent == 0 )
+		output->event_sent = now_nsec();
+	output->requests_at_event = (uint32_t)requests;
+}
+
+/* Records closer together than this are sent at once, as they most likely
+ * were received in a single dispatch when recording.
+ */
+#define REPLAY_BURST_NSEC 100000
+
+/* When replaying as fast as possible, how often to check whether the client
+ * has read all events sent so far.
+ */
+#define REPLAY_POLL_NSEC 50000
+
+/* The whole trace, read into memory before starting. */
+uint8_t *replay_data = NULL;
+size_t replay_size = 0;
+size_t replay_offset = 0;
+uint32_t replay_outputs = 0;
+uint64_t replay_start = 0;
+bool replay_fast = false;
+int replay_timer_fd = -1;
+
+static struct Output *output_from_trace_name (uint32_t name)
+{
+	struct Output *output;
+	wl_list_for_each(output, &outputs, link)
+		if ( output->global != NULL && output->trace_name == name )
+			return output;
+	return NULL;
+}
+
+/* Reads the trace at path and checks that all records are complete.
+ * Returns the amount of records, or -1 on error.
+ */
+static int64_t load_trace (const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if ( file == NULL )
+	{
+		fprintf(stderr, "ERROR: fopen: %s: %s.\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct Trace_header header;
+	if ( fread(&header, sizeof(header), 1, file) != 1
+			|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != TRACE_VERSION )
+	{
+		fprintf(stderr, "ERROR: %s is not a trace of version %d.\n", path, TRACE_VERSION);
+		fclose(file);
+		return -1;
+	}
+
+	size_t capacity = 0;
+	for (;;)
+	{
+		if ( replay_size == capacity )
+		{
+			capacity = capacity == 0 ? 65536 : 2 * capacity;
+			uint8_t *tmp = realloc(replay_data, capacity);
+			if ( tmp == NULL )
+			{
+				fprintf(stderr, "ERROR: realloc: %s.\n", strerror(errno));
+				fclose(file);
+				return -1;
+			}
+			replay_data = tmp;
+		}
+		const size_t read = fread(replay_data + replay_size, 1, capacity - replay_size, file);
+		if ( read == 0 )
+			break;
+		replay_size += read;
+	}
+	if ( ferror(file) )
+	{
+		fprintf(stderr, "ERROR: fread: %s: %s.\n", path, strerror(errno));
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	/* Records are not aligned, as payloads can have any length. */
+	int64_t records = 0;
+	size_t offset = 0;
+	while ( replay_size - offset >= sizeof(struct Trace_record) )
+	{
+		struct Trace_record record;
+		memcpy(&record, replay_data + offset, sizeof(record));
+		if ( replay_size - offset - sizeof(record) < record.length )
+			break;
+		offset += sizeof(record) + record.length;
+		records++;
+	}
+
+	/* A recording cut short may end with a partial record. */
+	if ( offset < replay_size )
+		fprintf(stderr, "WARNING: Ignoring incomplete record at the end of %s.\n", path);
+	replay_size = offset;
+
+	return records;
+}
+
+static void replay_record (const struct Trace_record *record, const uint8_t *payload)
+{
+	struct Output *output = output_from_trace_name(record->output);
+	struct wl_resource *resource;
+	uint32_t value = 0;
+	if ( record->length >= sizeof(value) )
+		memcpy(&value, payload, sizeof(value));
+
+	switch ((enum Trace_type)record->type)
+	{
+		case TRACE_OUTPUT_ADD:
+			if ( output != NULL )
+				break;
+			output = create_output(replay_outputs++);
+			if ( output != NULL )
+				output->trace_name = record->output;
+			break;
+
+		case TRACE_OUTPUT_REMOVE:
+			if ( output == NULL )
+				break;
+
+			/* The output stays in the list, as surfaces may still
+			 * point to it.
+			 */
+			wl_global_destroy(output->global);
+			output->global = NULL;
+			if ( focused_output == output )
+				focused_output = NULL;
+			break;
+
+		case TRACE_OUTPUT_SCALE:
+			if ( output == NULL )
+				break;
+			output->scale = (int32_t)value;
+			wl_resource_for_each(resource, &output->resources)
+			{
+				wl_output_send_scale(resource, output->scale);
+				wl_output_send_done(resource);
+			}
+			break;
+
+		case TRACE_FOCUSED_TAGS:
+			if ( output == NULL )
+				break;
+			output->focused_tags = value;
+			mark_event(output);
+			wl_resource_for_each(resource, &output->status_resources)
+				zriver_output_status_v1_send_focused_tags(resource, value);
+			break;
+
+		case TRACE_URGENT_TAGS:
+			if ( output == NULL )
+				break;
+			output->urgent_tags = value;
+			wl_resource_for_each(resource, &output->status_resources)
+				if ( wl_resource_get_version(resource) >= ZRIVER_OUTPUT_STATUS_V1_URGENT_TAGS_SINCE_VERSION )
+					zriver_output_status_v1_send_urgent_tags(resource, value);
+			break;
+
+		case TRACE_VIEW_TAGS:
+		{
+			if ( output == NULL )
+				break;
+
+			struct wl_array view_tags;
+			wl_array_init(&view_tags);
+			uint32_t *tags = wl_array_add(&view_tags, record->length);
+			if ( tags == NULL && record->length > 0 )
+				break;
+			if ( record->length > 0 )
+				memcpy(tags, payload, record->length);
+
+			/* New status objects get the tags of all views at once. */
+			output->view_tags = 0;
+			wl_array_for_each(tags, &view_tags)
+				output->view_tags |= *tags;
+
+			wl_resource_for_each(resource, &output->status_resources)
+				zriver_output_status_v1_send_view_tags(resource, &view_tags);
+			wl_array_release(&view_tags);
+			break;
+		}
+
+		case TRACE_FOCUSED_OUTPUT:
+			if ( output == NULL )
+				break;
+			focused_output = output;
+			mark_event(output);
+			wl_resource_for_each(resource, &seat_status_resources)
+				send_focused_output(resource);
+			break;
+
+		case TRACE_UNFOCUSED_OUTPUT:
+			if ( output == NULL )
+				break;
+			if ( focused_output == output )
+				focused_output = NULL;
+			wl_resource_for_each(resource, &seat_status_resources)
+			{
+				struct wl_resource *wl_output = output_resource(output,
+						wl_resource_get_client(resource));
+				if ( wl_output != NULL )
+					zriver_seat_status_v1_send_unfocused_output(resource, wl_output);
+			}
+			break;
+
+		case TRACE_FOCUSED_VIEW:
+		{
+			char *title = strndup((const char *)payload, record->length);
+			if ( title == NULL )
+				break;
+			wl_resource_for_each(resource, &seat_status_resources)
+				zriver_seat_status_v1_send_focused_view(resource, title);
+			free(title);
+			break;
+		}
+
+		default:
+			fprintf(stderr, "WARNING: Unknown trace record type %u.\n", record->type);
+			break;
+	}
+}
+
+static void arm_timer (int fd, uint64_t deadline)
+{
+	const struct itimerspec spec = {
+		.it_value = {
+			.tv_sec  = (time_t)(deadline / 1000000000UL),
+			.tv_nsec = (long)(deadline % 1000000000UL),
+		},
+	};
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/* Bytes sent to the client it has not read yet. */
+static int client_backlog (void)
+{
+	int pending = 0;
+	wl_client_flush(client);
+	if ( ioctl(client_fd, SIOCOUTQ, &pending) < 0 )
+		return 0;
+	return pending;
+}
+
+/* Sends the next burst of records and arms the timer for the one after,
+ * either at its recorded time or, when replaying as fast as possible, as
+ * soon as the client has read everything.
+ */
+static int handle_replay_timer (int fd, uint32_t mask, void *data)
+{
+	uint64_t expirations;
+	if ( read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN )
+	{
+		fprintf(stderr, "ERROR: read: %s.\n", strerror(errno));
+		wl_display_terminate(wl_display);
+		return 0;
+	}
+
+	if ( replay_offset == replay_size )
+	{
+		wl_display_terminate(wl_display);
+		return 0;
+	}
+
+	if ( replay_fast && client_backlog() > 0 )
+	{
+		arm_timer(replay_timer_fd, now_nsec() + REPLAY_POLL_NSEC);
+		return 0;
+	}
+
+	struct Trace_record record;
+	memcpy(&record, replay_data + replay_offset, sizeof(record));
+	const uint64_t burst_start = record.time;
+	do
+	{
+		replay_offset += sizeof(record);
+		replay_record(&record, replay_data + replay_offset);
+		replay_offset += record.length;
+		events_sent++;
+		if ( replay_offset == replay_size )
+			break;
+		memcpy(&record, replay_data + replay_offset, sizeof(record));
+	} while ( record.time - burst_start < REPLAY_BURST_NSEC );
+
+	if ( replay_offset == replay_size )
+		arm_timer(replay_timer_fd, now_nsec() + (uint64_t)event_interval * 1000000);
+	else if ( replay_fast )
+		arm_timer(replay_timer_fd, now_nsec() + REPLAY_POLL_NSEC);
+	else
+		arm_timer(replay_timer_fd, replay_start + record.time);
+	return 0;
+}
+
+static bool start_replay (void)
+{
+	replay_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if ( replay_timer_fd == -1 )
+	{
+		fprintf(stderr, "ERROR: timerfd_create: %s.\n", strerror(errno));
+		return false;
+	}
+	wl_event_loop_add_fd(loop, replay_timer_fd, WL_EVENT_READABLE, handle_replay_timer, NULL);
+
+	struct Trace_record first = { 0 };
+	if ( replay_size > 0 )
+		memcpy(&first, replay_data, sizeof(first));
+	replay_start = now_nsec();
+	arm_timer(replay_timer_fd, replay_start + (replay_fast ? 0 : first.time));
+	return true;
+}
+
+/**********
+ *        *
+ *  Main  *
+ *        *
+ **********/
+static void handle_protocol_message (void *data, enum wl_protocol_logger_type direction,
+		const struct wl_protocol_logger_message *message)
+{
+	if ( direction != WL_PROTOCOL_LOGGER_REQUEST )
+		return;
+	requests++;
+	if ( strcmp(message->message->name, "create_buffer") == 0 )
+		buffers_created++;
+}
+
+static int handle_refresh (void *data)
+{
+	struct wl_resource *callback, *tmp;
+	const uint32_t time = (uint32_t)(now_nsec() / 1000000);
+	tick++;
+	release_held_buffers();
+	wl_resource_for_each_safe(callback, tmp, &frame_callbacks)
+	{
+		wl_callback_send_done(callback, time);
+		wl_resource_destroy(callback);
+	}
+	wl_event_source_timer_update(refresh_timer, (int)refresh_period);
+	return 0;
+}
+
+/* Outputs take turns, unless they are mirrored and all get every event. */
+static void send_scripted_event (void)
+{
+	const uint32_t tag = (mirror_outputs ? events_sent : events_sent / output_amount) % 9;
+	struct Output *output;
+	wl_list_for_each(output, &outputs, link)
+	{
+		if ( ! mirror_outputs && output->index != events_sent % output_amount )
+			continue;
+
+		output->focused_tags = 1u << tag;
+		output->view_tags ^= 1u << ((tag + 5) % 9);
+		output->urgent_tags = (events_sent % 4 == 3) ? 1u << ((tag + 3) % 9) : 0;
+
+		mark_event(output);
+
+		struct wl_resource *resource;
+		wl_resource_for_each(resource, &output->status_resources)
+			send_output_status(resource, output);
+	}
+
+	events_sent++;
+}
+
+static int handle_event_timer (void *data)
+{
+	if ( events_sent == event_amount )
+	{
+		wl_display_terminate(wl_display);
+		return 0;
+	}
+
+	send_scripted_event();
+	wl_event_source_timer_update(event_timer, (int)event_interval);
+	return 0;
+}
+
+/**********
+ *        *
+ *  Load  *
+ *        *
+ **********/
+/* Time to let the client settle after the last event of the load. */
+#define LOAD_SETTLE_NSEC 200000000
+
+/* Events per second of the load generator, 0 if it is not used. */
+uint32_t load_rate = 0;
+uint64_t load_start = 0;
+uint64_t load_end = 0;
+int load_timer_fd = -1;
+
+/* The client writes its statistics here when the load is over. */
+char load_stats_path[] = "/tmp/river-tag-overlay-harness-XXXXXX";
+uint64_t load_renders = 0;
+uint64_t load_frames_dropped = 0;
+
+static uint64_t load_event_time (uint32_t event)
+{
+	return load_start + (uint64_t)event * 1000000000UL / load_rate;
+}
+
+/* Sends all events that are due, so the rate holds even when the harness
+ * falls behind, and arms the timer for the next one.
+ */
+static int handle_load_timer (int fd, uint32_t mask, void *data)
+{
+	uint64_t expirations;
+	if ( read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN )
+	{
+		fprintf(stderr, "ERROR: read: %s.\n", strerror(errno));
+		wl_display_terminate(wl_display);
+		return 0;
+	}
+
+	if ( events_sent == event_amount )
+	{
+		wl_display_terminate(wl_display);
+		return 0;
+	}
+
+	const uint64_t now = now_nsec();
+	while ( events_sent < event_amount && load_event_time(events_sent) <= now )
+		send_scripted_event();
+
+	if ( events_sent == event_amount )
+	{
+		load_end = now;
+		arm_timer(fd, now + LOAD_SETTLE_NSEC);
+	}
+	else
+		arm_timer(fd, load_event_time(events_sent));
+	return 0;
+}
+
+static bool start_load (void)
+{
+	load_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if ( load_timer_fd == -1 )
+	{
+		fprintf(stderr, "ERROR: timerfd_create: %s.\n", strerror(errno));
+		return false;
+	}
+	wl_event_loop_add_fd(loop, load_timer_fd, WL_EVENT_READABLE, handle_load_timer, NULL);
+
+	/* Give the client time to bind its globals before the load starts. */
+	load_start = now_nsec() + 200000000;
+	arm_timer(load_timer_fd, load_start);
+	return true;
+}
+
+/* Reads a counter from the statistics the client wrote. */
+static bool read_client_stat (const char *stats, const char *name, uint64_t *value)
+{
+	char key[64];
+	snprintf(key, sizeof(key), "\"%s\":", name);
+	const char *position = strstr(stats, key);
+	unsigned long tmp;
+	if ( position == NULL || sscanf(position + strlen(key), "%lu", &tmp) != 1 )
+		return false;
+	*value = tmp;
+	return true;
+}
+
+/* Reads the renders and dropped frames from the statistics the client
+ * wrote when asked for them at exit.
+ */
+static bool read_client_stats (void)
+{
+	char stats[4096] = "";
+	FILE *file = fopen(load_stats_path, "r");
+	if ( file != NULL )
+	{
+		stats[fread(stats, 1, sizeof(stats) - 1, file)] = '\0';
+		fclose(file);
+	}
+	unlink(load_stats_path);
+
+	if (! read_client_stat(stats, "renders", &load_renders)
+			|| ! read_client_stat(stats, "frames_dropped", &load_frames_dropped) )
+	{
+		fputs("ERROR: The client did not write its statistics.\n", stderr);
+		return false;
+	}
+	return true;
+}
+
+static int compare_u64 (const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile (double p)
+{
+	if ( latency_count == 0 )
+		return 0.0;
+	uint32_t i = (uint32_t)(p * (double)(latency_count - 1) + 0.5);
+	return (double)latencies[i] / 1000.0;
+}
+
+static void print_results (void)
+{
+	qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+	fprintf(stdout,
+			"{\"events\":%u,\"popups\":%u,\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+			"\"requests\":%lu,\"requests_per_popup\":%.2f,\"commits\":%lu,\"buffers_created\":%lu,\"damage_errors\":%lu,"
+			"\"opaque_commits\":%lu,\"client_cpu_ms\":%.1f,\"client_peak_rss_kb\":%lu",
+			events_sent, latency_count,
+			percentile(0.50), percentile(0.90), percentile(0.99), percentile(1.0),
+			(unsigned long)requests,
+			latency_count == 0 ? 0.0 : (double)popup_requests / latency_count,
+			(unsigned long)commits, (unsigned long)buffers_created,
+			(unsigned long)damage_errors, (unsigned long)opaque_commits,
+			(double)client_cpu_nsec / 1000000.0, (unsigned long)client_peak_rss);
+
+	/* CPU time includes the start-up of the client. */
+	if ( load_rate > 0 )
+	{
+		const double events = events_sent > 0 ? (double)events_sent : 1.0;
+		const double achieved = events_sent > 1 && load_end > load_start
+			? (double)(events_sent - 1) * 1000000000.0 / (double)(load_end - load_start)
+			: (double)load_rate;
+		fprintf(stdout, ",\"load\":{\"rate_hz\":%u,\"achieved_hz\":%.1f,\"outputs\":%u,"
+				"\"cpu_us_per_event\":%.2f,\"renders_per_event\":%.3f,\"frames_dropped\":%lu}",
+				load_rate, achieved, output_amount,
+				(double)client_cpu_nsec / 1000.0 / events,
+				(double)load_renders / events, (unsigned long)load_frames_dropped);
+	}
+	fputs("}\n", stdout);
+}
+
+static void handle_client_destroy (struct wl_listener *listener, void *data)
+{
+	client_alive = false;
+	wl_display_terminate(wl_display);
+}
+
+int main (int argc, char *argv[])
+{
+	enum
+	{
+		EVENTS,
+		INTERVAL,
+		OUTPUTS,
+		REFRESH,
+		CHECKSUMS,
+		SCALE,
+		HOLD,
+		REPLAY,
+		FAST,
+		SUBSURFACES,
+		MIRROR,
+		RATE,
+	};
+
+	static struct option opts[] = {
+		{ "help",        no_argument,       NULL, 'h'         },
+		{ "events",      required_argument, NULL, EVENTS      },
+		{ "interval",    required_argument, NULL, INTERVAL    },
+		{ "outputs",     required_argument, NULL, OUTPUTS     },
+		{ "refresh",     required_argument, NULL, REFRESH     },
+		{ "checksums",   no_argument,       NULL, CHECKSUMS   },
+		{ "scale",       required_argument, NULL, SCALE       },
+		{ "hold",        required_argument, NULL, HOLD        },
+		{ "replay",      required_argument, NULL, REPLAY      },
+		{ "fast",        no_argument,       NULL, FAST        },
+		{ "subsurfaces", no_argument,       NULL, SUBSURFACES },
+		{ "mirror",      no_argument,       NULL, MIRROR      },
+		{ "rate",        required_argument, NULL, RATE        },
+		{ NULL,          0,                 NULL, 0           },
+	};
+
+	const char *replay_path = NULL;
+
+	int opt;
+	while ( (opt = getopt_long(argc, argv, "h", opts, NULL)) != -1 ) switch (opt)
+	{
+		case 'h':
+			fputs(usage, stderr);
+			return EXIT_SUCCESS;
+
+		case EVENTS:      event_amount      = (uint32_t)atoi(optarg); break;
+		case INTERVAL:    event_interval    = (uint32_t)atoi(optarg); break;
+		case OUTPUTS:     output_amount     = (uint32_t)atoi(optarg); break;
+		case REFRESH:     refresh_period    = (uint32_t)atoi(optarg); break;
+		case CHECKSUMS:   print_checksums   = true;                   break;
+		case SCALE:       output_scale      = atoi(optarg);           break;
+		case HOLD:        hold_frames       = (uint32_t)atoi(optarg); break;
+		case REPLAY:      replay_path       = optarg;                 break;
+		case FAST:        replay_fast       = true;                   break;
+		case SUBSURFACES: offer_subsurfaces = true;                   break;
+		case MIRROR:      mirror_outputs    = true;                   break;
+		case RATE:        load_rate         = (uint32_t)atoi(optarg); break;
+
+		default:
+			return EXIT_FAILURE;
+	}
+
+	if ( optind >= argc || output_amount == 0 || refresh_period == 0
+			|| event_interval == 0 || output_scale < 1 )
+	{
+		fputs(usage, stderr);
+		return EXIT_FAILURE;
+	}
+
+	if ( load_rate > 0 && (load_rate > 10000 || output_amount > 8 || replay_path != NULL) )
+	{
+		fputs("ERROR: The load generator sends 1 to 10000 events per second to 1 to 8 outputs, "
+				"and can not replay traces.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if ( replay_path != NULL )
+	{
+		const int64_t records = load_trace(replay_path);
+		if ( records < 0 )
+			return EXIT_FAILURE;
+		event_amount = (uint32_t)records;
+	}
+
+	/* Mirrored outputs each commit for every event. */
+	latencies = calloc((size_t)event_amount * (mirror_outputs ? output_amount : 1) + 1,
+			sizeof(uint64_t));
+	if ( latencies == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	wl_display = wl_display_create();
+	loop = wl_display_get_event_loop(wl_display);
+	wl_list_init(&outputs);
+	wl_list_init(&frame_callbacks);
+	wl_list_init(&seat_status_resources);
+
+	wl_display_init_shm(wl_display);
+	wl_display_add_shm_format(wl_display, WL_SHM_FORMAT_RGB565);
+	wl_global_create(wl_display, &wl_compositor_interface, 4, NULL, bind_compositor);
+	wl_global_create(wl_display, &zwlr_layer_shell_v1_interface, 1, NULL, bind_layer_shell);
+	wl_global_create(wl_display, &zriver_status_manager_v1_interface, 2, NULL, bind_status_manager);
+	wl_global_create(wl_display, &wl_seat_interface, 7, NULL, bind_seat);
+	if (offer_subsurfaces)
+	{
+		wl_global_create(wl_display, &wl_subcompositor_interface, 1, NULL, bind_subcompositor);
+		wl_global_create(wl_display, &wp_viewporter_interface, 1, NULL, bind_viewporter);
+		wl_global_create(wl_display, &wp_single_pixel_buffer_manager_v1_interface, 1, NULL,
+				bind_single_pixel_buffer_manager);
+	}
+
+	/* When replaying, outputs are added by the trace. */
+	for (uint32_t i = 0; replay_path == NULL && i < output_amount; i++)
+	{
+		struct Output *output = create_output(i);
+		if ( output == NULL )
+			return EXIT_FAILURE;
+		output->focused_tags = 1;
+	}
+	wl_display_add_protocol_logger(wl_display, handle_protocol_message, NULL);
+
+	int fds[2];
+	if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0 )
+	{
+		fprintf(stderr, "ERROR: socketpair: %s.\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Under load, the client is asked for its statistics when the load
+	 * is over.
+	 */
+	char **child_argv = &argv[optind];
+	if ( load_rate > 0 )
+	{
+		const int stats_fd = mkstemp(load_stats_path);
+		child_argv = calloc((size_t)(argc - optind) + 3, sizeof(char *));
+		if ( stats_fd == -1 || child_argv == NULL )
+		{
+			fprintf(stderr, "ERROR: Can not set up the statistics file: %s.\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		close(stats_fd);
+		memcpy(child_argv, &argv[optind], (size_t)(argc - optind) * sizeof(char *));
+		child_argv[argc - optind] = "--stats-file";
+		child_argv[argc - optind + 1] = load_stats_path;
+	}
+
+	child = fork();
+	if ( child < 0 )
+	{
+		fprintf(stderr, "ERROR: fork: %s.\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	else if ( child == 0 )
+	{
+		char fd_str[16];
+		const int fd = dup(fds[1]);
+		snprintf(fd_str, sizeof(fd_str), "%d", fd);
+		setenv("WAYLAND_SOCKET", fd_str, 1);
+		setenv("WAYLAND_DISPLAY", "river-tag-overlay-harness", 1);
+		execvp(child_argv[0], child_argv);
+		fprintf(stderr, "ERROR: execvp: %s.\n", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	close(fds[1]);
+
+	client_fd = fds[0];
+	client = wl_client_create(wl_display, client_fd);
+	struct wl_listener client_destroy = { .notify = handle_client_destroy };
+	wl_client_add_destroy_listener(client, &client_destroy);
+
+	refresh_timer = wl_event_loop_add_timer(loop, handle_refresh, NULL);
+	wl_event_source_timer_update(refresh_timer, (int)refresh_period);
+
+	if ( replay_path != NULL )
+	{
+		if (! start_replay())
+			return EXIT_FAILURE;
+	}
+	else if ( load_rate > 0 )
+	{
+		if (! start_load())
+			return EXIT_FAILURE;
+	}
+	else
+	{
+		/* Give the client time to bind its globals before the script starts. */
+		event_timer = wl_event_loop_add_timer(loop, handle_event_timer, NULL);
+		wl_event_source_timer_update(event_timer, 200);
+	}
+
+	wl_display_run(wl_display);
+
+	if ( client_alive )
+		wl_list_remove(&client_destroy.link);
+
+	/* Pending signals are read in order of their number, so the client
+	 * writes its statistics before it exits.
+	 */
+	if ( load_rate > 0 )
+		kill(child, SIGUSR1);
+	kill(child, SIGTERM);
+	struct rusage rusage;
+	if ( wait4(child, NULL, 0, &rusage) == child )
+	{
+		client_cpu_nsec = (uint64_t)rusage.ru_utime.tv_sec * 1000000000UL
+			+ (uint64_t)rusage.ru_utime.tv_usec * 1000
+			+ (uint64_t)rusage.ru_stime.tv_sec * 1000000000UL
+			+ (uint64_t)rusage.ru_stime.tv_usec * 1000;
+		client_peak_rss = (uint64_t)rusage.ru_maxrss;
+	}
+	if ( load_rate > 0 && ! read_client_stats() )
+		ret = EXIT_FAILURE;
+
+	print_results();
+
+	wl_display_destroy(wl_display);
+	if ( replay_timer_fd != -1 )
+		close(replay_timer_fd);
+	if ( load_timer_fd != -1 )
+		close(load_timer_fd);
+	if ( child_argv != &argv[optind] )
+		free(child_argv);
+	free(replay_data);
+	free(latencies);
+
+	return ret;
+}
@@ -0,0 +1,82 @@
+#include "histogram.h"
+
+static uint32_t bucket_index (uint64_t value)
+{
+	if ( value < HISTOGRAM_SUB_BUCKETS )
+		return (uint32_t)value;
+	const uint32_t msb = 63 - (uint32_t)__builtin_clzll(value);
+	const uint32_t shift = msb - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS
+		+ (uint32_t)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Lowest value that is counted in the bucket. */
+static uint64_t bucket_value (uint32_t index)
+{
+	if ( index < HISTOGRAM_SUB_BUCKETS )
+		return index;
+	const uint32_t shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+	return (uint64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+void histogram_record (struct Histogram *histogram, uint64_t value)
+{
+	if ( histogram->count == 0 || value < histogram->min )
+		histogram->min = value;
+	if ( value > histogram->max )
+		histogram->max = value;
+	histogram->count++;
+	histogram->buckets[bucket_index(value)]++;
+}
+
+uint64_t histogram_percentile (struct Histogram *histogram, double percentile)
+{
+	if ( histogram->count == 0 )
+		return 0;
+
+	uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->count + 0.5);
+	if ( rank < 1 )
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram->buckets[i];
+		if ( seen >= rank )
+		{
+			/* The bucket bound may lie outside the recorded range. */
+			const uint64_t value = bucket_value(i);
+			if ( value < histogram->min )
+				return histogram->min;
+			return value > histogram->max ? histogram->max : value;
+		}
+	}
+	return histogram->max;
+}
+
+/* Writes the summary and the non-empty buckets, as pairs of the lowest
+ * value of the bucket and its count.
+ */
+void histogram_write_json (struct Histogram *histogram, FILE *file)
+{
+	fprintf(file, "{\"count\":%lu,\"min\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,"
+			"\"p99.9\":%lu,\"max\":%lu,\"buckets\":[",
+			(unsigned long)histogram->count, (unsigned long)histogram->min,
+			(unsigned long)histogram_percentile(histogram, 50.0),
+			(unsigned long)histogram_percentile(histogram, 90.0),
+			(unsigned long)histogram_percentile(histogram, 99.0),
+			(unsigned long)histogram_percentile(histogram, 99.9),
+			(unsigned long)histogram->max);
+
+	const char *separator = "";
+	for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if ( histogram->buckets[i] == 0 )
+			continue;
+		fprintf(file, "%s[%lu,%lu]", separator, (unsigned long)bucket_value(i),
+				(unsigned long)histogram->buckets[i]);
+		separator = ",";
+	}
+
+	fputs("]}", file);
+}
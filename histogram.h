@@ -0,0 +1,29 @@
+#ifndef RIVER_TAG_OVERLAY_HISTOGRAM_H
+#define RIVER_TAG_OVERLAY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Values below 2^HISTOGRAM_SUB_BITS get a bucket each; every power of two
+ * above is split into 2^HISTOGRAM_SUB_BITS buckets, so the recorded value
+ * of any sample is at most 12.5% below the real one.
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/* Log-linear histogram of 64 bit values with a fixed size and constant time
+ * recording, in the spirit of HdrHistogram.
+ */
+struct Histogram
+{
+	uint64_t count;
+	uint64_t min, max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_record (struct Histogram *histogram, uint64_t value);
+uint64_t histogram_percentile (struct Histogram *histogram, double percentile);
+void histogram_write_json (struct Histogram *histogram, FILE *file);
+
+#endif
@@ -0,0 +1,539 @@
+#include <errno.h>
+#include <fontconfig/fontconfig.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_BITMAP_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "label.h"
+
+/* In code points. */
+#define LABEL_LENGTH_MAX 16
+
+uint32_t tag_label_amount = 0;
+struct wl_list label_atlases;
+uint64_t glyphs_rasterized = 0;
+
+static uint32_t labels[32][LABEL_LENGTH_MAX];
+static size_t label_lengths[32];
+
+static FT_Library library = NULL;
+static FT_Face face = NULL;
+
+/* A glyph of a label, relative to the top left corner of the label. */
+struct Placed_glyph
+{
+	int32_t atlas_x, x, y, width, height;
+};
+
+struct Label
+{
+	struct Placed_glyph glyphs[LABEL_LENGTH_MAX];
+	size_t glyph_amount;
+	int32_t width, height;
+};
+
+/* The glyphs of all labels for one scale, rendered once into an A8 image
+ * and laid out horizontally, and where to put them for every label. As
+ * the font size follows the square size, they depend on the font, the
+ * sizes and the scale.
+ */
+struct Label_atlas
+{
+	struct wl_list link;
+	uint32_t scale;
+	pixman_image_t *pixman_image;
+
+	/* Labels are drawn in the border colour of the square. */
+	pixman_image_t *colours[SQUARE_STATE_AMOUNT];
+
+	struct Label labels[32];
+};
+
+/* A glyph while the atlas is created. */
+struct Glyph
+{
+	FT_UInt index;
+	int32_t left, top, width, height, advance, atlas_x;
+	uint8_t *bitmap;
+};
+
+/************
+ *          *
+ *  Config  *
+ *          *
+ ************/
+/* Decodes one UTF-8 encoded code point and returns its length in bytes,
+ * or 0 if it is not valid.
+ */
+static size_t decode_utf8 (const char *str, uint32_t *code_point)
+{
+	const uint8_t *s = (const uint8_t *)str;
+	size_t length;
+	if ( s[0] < 0x80 )
+	{
+		*code_point = s[0];
+		return 1;
+	}
+	else if ( (s[0] & 0xe0) == 0xc0 )
+	{
+		*code_point = s[0] & 0x1f;
+		length = 2;
+	}
+	else if ( (s[0] & 0xf0) == 0xe0 )
+	{
+		*code_point = s[0] & 0x0f;
+		length = 3;
+	}
+	else if ( (s[0] & 0xf8) == 0xf0 )
+	{
+		*code_point = s[0] & 0x07;
+		length = 4;
+	}
+	else
+		return 0;
+
+	for (size_t i = 1; i < length; i++)
+	{
+		if ( (s[i] & 0xc0) != 0x80 )
+			return 0;
+		*code_point = *code_point << 6 | (s[i] & 0x3f);
+	}
+	return length;
+}
+
+bool parse_tag_labels (const char *str)
+{
+	tag_label_amount = 0;
+	for (const char *c = str;; c++)
+	{
+		if ( tag_label_amount == 32 )
+		{
+			fputs("ERROR: Can only label 32 tags.\n", stderr);
+			return false;
+		}
+
+		const uint32_t tag = tag_label_amount++;
+		label_lengths[tag] = 0;
+		while ( *c != '\0' && *c != ':' )
+		{
+			if ( label_lengths[tag] == LABEL_LENGTH_MAX )
+			{
+				fprintf(stderr, "ERROR: Tag labels may be at most %d characters long.\n",
+						LABEL_LENGTH_MAX);
+				return false;
+			}
+
+			const size_t length = decode_utf8(c, &labels[tag][label_lengths[tag]++]);
+			if ( length == 0 )
+			{
+				fputs("ERROR: Tag labels must be UTF-8.\n", stderr);
+				return false;
+			}
+			c += length;
+		}
+
+		if ( *c == '\0' )
+			return true;
+	}
+}
+
+/**********
+ *        *
+ *  Font  *
+ *        *
+ **********/
+static bool open_face (const char *path, int index)
+{
+	if ( FT_New_Face(library, path, index, &face) != 0 )
+	{
+		fprintf(stderr, "ERROR: Can not load font '%s'.\n", path);
+		return false;
+	}
+	return true;
+}
+
+/* Loads the font for the labels. A path is loaded as is, anything else is
+ * looked up with fontconfig. This is the only font lookup; glyphs are
+ * rendered when the atlas of a scale is created.
+ */
+bool load_font (const char *name)
+{
+	if ( FT_Init_FreeType(&library) != 0 )
+	{
+		fputs("ERROR: Can not initialize FreeType.\n", stderr);
+		return false;
+	}
+
+	if ( strchr(name, '/') != NULL )
+		return open_face(name, 0);
+
+	FcConfig *config = FcInitLoadConfigAndFonts();
+	if ( config == NULL )
+	{
+		fputs("ERROR: Can not initialize fontconfig.\n", stderr);
+		return false;
+	}
+
+	bool ret = false;
+	FcPattern *pattern = FcNameParse((const FcChar8 *)name);
+	FcPattern *match = NULL;
+	if ( pattern != NULL )
+	{
+		FcConfigSubstitute(config, pattern, FcMatchPattern);
+		FcDefaultSubstitute(pattern);
+
+		FcResult result;
+		match = FcFontMatch(config, pattern, &result);
+	}
+
+	FcChar8 *path;
+	int index = 0;
+	if ( match != NULL && FcPatternGetString(match, FC_FILE, 0, &path) == FcResultMatch )
+	{
+		FcPatternGetInteger(match, FC_INDEX, 0, &index);
+		ret = open_face((const char *)path, index);
+	}
+	else
+		fprintf(stderr, "ERROR: Can not find font '%s'.\n", name);
+
+	if ( match != NULL )
+		FcPatternDestroy(match);
+	if ( pattern != NULL )
+		FcPatternDestroy(pattern);
+	FcConfigDestroy(config);
+	return ret;
+}
+
+void finish_font (void)
+{
+	if ( face != NULL )
+		FT_Done_Face(face);
+	if ( library != NULL )
+		FT_Done_FreeType(library);
+	face = NULL;
+	library = NULL;
+}
+
+/***********
+ *         *
+ *  Atlas  *
+ *         *
+ ***********/
+static void destroy_label_atlas (struct Label_atlas *atlas)
+{
+	wl_list_remove(&atlas->link);
+	if ( atlas->pixman_image != NULL )
+		pixman_image_unref(atlas->pixman_image);
+	for (uint32_t i = 0; i < SQUARE_STATE_AMOUNT; i++)
+		if ( atlas->colours[i] != NULL )
+			pixman_image_unref(atlas->colours[i]);
+	free(atlas);
+}
+
+void destroy_label_atlases (void)
+{
+	struct Label_atlas *atlas, *tmp;
+	wl_list_for_each_safe(atlas, tmp, &label_atlases, link)
+		destroy_label_atlas(atlas);
+}
+
+/* Renders a glyph unless it already is in glyphs, and returns its index
+ * there, or -1 on failure.
+ */
+static int32_t add_glyph (struct Glyph *glyphs, size_t *glyph_amount,
+		int32_t *atlas_width, int32_t *atlas_height, uint32_t code_point)
+{
+	const FT_UInt index = FT_Get_Char_Index(face, code_point);
+	for (size_t i = 0; i < *glyph_amount; i++)
+		if ( glyphs[i].index == index )
+			return (int32_t)i;
+
+	if ( FT_Load_Glyph(face, index, FT_LOAD_RENDER) != 0 )
+	{
+		fprintf(stderr, "ERROR: Can not render glyph for U+%04X.\n", code_point);
+		return -1;
+	}
+	glyphs_rasterized++;
+
+	/* Outlines are rendered with 8 bits of coverage, but bitmap strikes
+	 * may come with fewer, which are converted and scaled up to 8 bits.
+	 */
+	const FT_GlyphSlot slot = face->glyph;
+	const FT_Bitmap *bitmap = &slot->bitmap;
+	FT_Bitmap converted;
+	FT_Bitmap_Init(&converted);
+	if ( bitmap->pixel_mode != FT_PIXEL_MODE_GRAY )
+	{
+		if ( ( bitmap->pixel_mode != FT_PIXEL_MODE_MONO
+					&& bitmap->pixel_mode != FT_PIXEL_MODE_GRAY2
+					&& bitmap->pixel_mode != FT_PIXEL_MODE_GRAY4 )
+				|| FT_Bitmap_Convert(library, bitmap, &converted, 1) != 0 )
+		{
+			fprintf(stderr, "ERROR: Unsupported glyph bitmap for U+%04X.\n", code_point);
+			FT_Bitmap_Done(library, &converted);
+			return -1;
+		}
+		bitmap = &converted;
+	}
+
+	struct Glyph *glyph = &glyphs[*glyph_amount];
+	glyph->index = index;
+	glyph->left = slot->bitmap_left;
+	glyph->top = slot->bitmap_top;
+	glyph->width = (int32_t)bitmap->width;
+	glyph->height = (int32_t)bitmap->rows;
+	glyph->advance = (int32_t)(slot->advance.x >> 6);
+	glyph->atlas_x = *atlas_width;
+	const size_t bitmap_size = (size_t)glyph->width * (size_t)glyph->height;
+	glyph->bitmap = bitmap_size > 0 ? malloc(bitmap_size) : NULL;
+	if ( bitmap_size > 0 && glyph->bitmap == NULL )
+	{
+		fprintf(stderr, "ERROR: malloc: %s.\n", strerror(errno));
+		FT_Bitmap_Done(library, &converted);
+		return -1;
+	}
+
+	/* Rows always go down by the pitch, but with a negative pitch the
+	 * buffer starts at the bottom row.
+	 */
+	const unsigned char *row = bitmap->buffer;
+	if ( bitmap->pitch < 0 && glyph->height > 0 )
+		row += (size_t)-bitmap->pitch * (size_t)(glyph->height - 1);
+	for (int32_t y = 0; y < glyph->height; y++, row += bitmap->pitch)
+		memcpy(glyph->bitmap + y * glyph->width, row, (size_t)glyph->width);
+	if ( bitmap->num_grays != 256 )
+		for (size_t i = 0; i < bitmap_size; i++)
+			glyph->bitmap[i] = (uint8_t)(glyph->bitmap[i] * 255 / (bitmap->num_grays - 1));
+	FT_Bitmap_Done(library, &converted);
+
+	*atlas_width += glyph->width;
+	if ( *atlas_height < glyph->height )
+		*atlas_height = glyph->height;
+	return (int32_t)(*glyph_amount)++;
+}
+
+/* Lays out the glyphs of a label along the baseline, relative to the top
+ * left corner of the ink of all glyphs.
+ */
+static void place_label (struct Label *label, struct Glyph *glyphs, int32_t *used, size_t length)
+{
+	int32_t pen = 0;
+	int32_t min_x = INT32_MAX, min_y = INT32_MAX, max_x = INT32_MIN, max_y = INT32_MIN;
+	label->glyph_amount = 0;
+	for (size_t i = 0; i < length; i++)
+	{
+		const struct Glyph *glyph = &glyphs[used[i]];
+		const int32_t x = pen + glyph->left;
+		const int32_t y = -glyph->top;
+		pen += glyph->advance;
+		if ( glyph->width == 0 || glyph->height == 0 )
+			continue;
+
+		label->glyphs[label->glyph_amount++] = (struct Placed_glyph){
+			glyph->atlas_x, x, y, glyph->width, glyph->height };
+		if ( x < min_x )
+			min_x = x;
+		if ( y < min_y )
+			min_y = y;
+		if ( x + glyph->width > max_x )
+			max_x = x + glyph->width;
+		if ( y + glyph->height > max_y )
+			max_y = y + glyph->height;
+	}
+
+	if ( label->glyph_amount == 0 )
+	{
+		label->width = label->height = 0;
+		return;
+	}
+
+	for (size_t i = 0; i < label->glyph_amount; i++)
+	{
+		label->glyphs[i].x -= min_x;
+		label->glyphs[i].y -= min_y;
+	}
+	label->width = max_x - min_x;
+	label->height = max_y - min_y;
+}
+
+static struct Label_atlas *create_label_atlas (uint32_t scale)
+{
+	struct Label_atlas *atlas = calloc(1, sizeof(struct Label_atlas));
+	if ( atlas == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
+		return NULL;
+	}
+	atlas->scale = scale;
+	wl_list_insert(&label_atlases, &atlas->link);
+
+	const uint32_t pixel_size = scale_length(square_size, scale) / 2;
+	if ( FT_Set_Pixel_Sizes(face, 0, pixel_size > 0 ? pixel_size : 1) != 0 )
+	{
+		fputs("ERROR: Can not set the font size.\n", stderr);
+		destroy_label_atlas(atlas);
+		return NULL;
+	}
+
+	/* Glyphs used by several labels are rendered once. */
+	struct Glyph glyphs[32 * LABEL_LENGTH_MAX];
+	int32_t used[32][LABEL_LENGTH_MAX];
+	size_t glyph_amount = 0;
+	int32_t atlas_width = 0, atlas_height = 0;
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < tag_label_amount; i++)
+		for (size_t j = 0; ok && j < label_lengths[i]; j++)
+		{
+			used[i][j] = add_glyph(glyphs, &glyph_amount,
+					&atlas_width, &atlas_height, labels[i][j]);
+			ok = used[i][j] >= 0;
+		}
+
+	if ( ok )
+		atlas->pixman_image = pixman_image_create_bits(PIXMAN_a8,
+				atlas_width > 0 ? atlas_width : 1,
+				atlas_height > 0 ? atlas_height : 1, NULL, 0);
+	if ( atlas->pixman_image != NULL )
+	{
+		uint8_t *data = (uint8_t *)pixman_image_get_data(atlas->pixman_image);
+		const size_t stride = (size_t)pixman_image_get_stride(atlas->pixman_image);
+		for (size_t i = 0; i < glyph_amount; i++)
+			for (int32_t y = 0; y < glyphs[i].height; y++)
+				memcpy(data + (size_t)y * stride + (size_t)glyphs[i].atlas_x,
+						glyphs[i].bitmap + y * glyphs[i].width,
+						(size_t)glyphs[i].width);
+
+		for (uint32_t i = 0; i < tag_label_amount; i++)
+			place_label(&atlas->labels[i], glyphs, used[i], label_lengths[i]);
+
+		for (uint32_t i = 0; i < SQUARE_STATE_AMOUNT; i++)
+		{
+			pixman_color_t *background, *border, *occupied;
+			square_colours((enum Square_state)i, &background, &border, &occupied);
+			atlas->colours[i] = pixman_image_create_solid_fill(border);
+			if ( atlas->colours[i] == NULL )
+				ok = false;
+		}
+	}
+	else
+		ok = false;
+
+	for (size_t i = 0; i < glyph_amount; i++)
+		free(glyphs[i].bitmap);
+
+	if (! ok)
+	{
+		destroy_label_atlas(atlas);
+		return NULL;
+	}
+
+	/* Pixman computes the properties of an image when it is first
+	 * composited, so that happens here rather than when several threads
+	 * draw labels at once.
+	 */
+	pixman_image_t *scratch = pixman_image_create_bits(PIXMAN_a8r8g8b8, 1, 1, NULL, 0);
+	for (uint32_t i = 0; scratch != NULL && i < SQUARE_STATE_AMOUNT; i++)
+		pixman_image_composite32(PIXMAN_OP_OVER, atlas->colours[i], atlas->pixman_image,
+				scratch, 0, 0, 0, 0, 0, 0, 1, 1);
+	if ( scratch != NULL )
+		pixman_image_unref(scratch);
+	return atlas;
+}
+
+static struct Label_atlas *get_label_atlas (uint32_t scale)
+{
+	struct Label_atlas *atlas;
+	wl_list_for_each(atlas, &label_atlases, link)
+		if ( atlas->scale == scale )
+			return atlas;
+	return create_label_atlas(scale);
+}
+
+/************
+ *          *
+ *  Labels  *
+ *          *
+ ************/
+/* Creates the atlas of the scale ahead of drawing. */
+bool prepare_labels (uint32_t scale)
+{
+	return tag_label_amount == 0 || get_label_atlas(scale) != NULL;
+}
+
+/* Draws the labels of the tags over their squares, which must already be
+ * drawn. If drawn is not NULL, only labels of squares that differ from it
+ * are drawn, as the others are still there. After the atlas of the scale
+ * exists, this only composites.
+ */
+bool draw_labels (pixman_image_t *image, uint32_t scale,
+		struct Tags *tags, struct Tags *drawn)
+{
+	if ( tag_label_amount == 0 )
+		return true;
+
+	struct Label_atlas *atlas = get_label_atlas(scale);
+	if ( atlas == NULL )
+		return false;
+
+	const int32_t size = (int32_t)scale_length(square_size, scale);
+	const uint32_t amount = tag_label_amount < tag_amount ? tag_label_amount : tag_amount;
+	for (uint32_t i = 0; i < amount; i++)
+	{
+		const uint32_t sprite = tag_sprite(tags, i);
+		if ( drawn != NULL && sprite == tag_sprite(drawn, i) )
+			continue;
+
+		/* Labels are clipped to their square, without the part the
+		 * next square is drawn over.
+		 */
+		uint32_t square_x, square_y;
+		square_position(i, scale, &square_x, &square_y);
+		const int32_t left = (int32_t)square_x, top = (int32_t)square_y;
+		int32_t right = left + size;
+		if ( i + 1 < tag_amount )
+		{
+			uint32_t next_x, next_y;
+			square_position(i + 1, scale, &next_x, &next_y);
+			if ( right > (int32_t)next_x )
+				right = (int32_t)next_x;
+		}
+
+		const struct Label *label = &atlas->labels[i];
+		const int32_t label_x = left + (size - label->width) / 2;
+		const int32_t label_y = top + (size - label->height) / 2;
+		pixman_image_t *colour = atlas->colours[sprite % SQUARE_STATE_AMOUNT];
+		for (size_t j = 0; j < label->glyph_amount; j++)
+		{
+			const struct Placed_glyph *glyph = &label->glyphs[j];
+			int32_t x = label_x + glyph->x, y = label_y + glyph->y;
+			int32_t width = glyph->width, height = glyph->height;
+			int32_t atlas_x = glyph->atlas_x, atlas_y = 0;
+			if ( x < left )
+			{
+				atlas_x += left - x;
+				width -= left - x;
+				x = left;
+			}
+			if ( y < top )
+			{
+				atlas_y += top - y;
+				height -= top - y;
+				y = top;
+			}
+			if ( x + width > right )
+				width = right - x;
+			if ( y + height > top + size )
+				height = top + size - y;
+			if ( width <= 0 || height <= 0 )
+				continue;
+
+			pixels_written += (uint64_t)width * (uint64_t)height;
+			pixman_image_composite32(PIXMAN_OP_OVER, colour, atlas->pixman_image, image,
+					0, 0, atlas_x, atlas_y, x, y, width, height);
+		}
+	}
+	return true;
+}
@@ -0,0 +1,29 @@
+#ifndef RIVER_TAG_OVERLAY_LABEL_H
+#define RIVER_TAG_OVERLAY_LABEL_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-util.h>
+
+#include "render.h"
+
+/* Amount of tags with a label, 0 if labels are not shown. */
+extern uint32_t tag_label_amount;
+
+extern struct wl_list label_atlases;
+
+/* Glyphs rendered by FreeType, to check that none are rendered once the
+ * atlases exist.
+ */
+extern uint64_t glyphs_rasterized;
+
+bool parse_tag_labels (const char *str);
+bool load_font (const char *name);
+void finish_font (void);
+void destroy_label_atlases (void);
+bool prepare_labels (uint32_t scale);
+bool draw_labels (pixman_image_t *image, uint32_t scale,
+		struct Tags *tags, struct Tags *drawn);
+
+#endif
@@ -0,0 +1,959 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#else
+#define HAVE_X86 0
+#endif
+
+#include "label.h"
+#include "render.h"
+
+uint32_t border_width = 2;
+uint32_t tag_amount = 9;
+uint32_t square_size = 40;
+uint32_t square_padding = 15;
+uint32_t square_border_width = 1;
+uint32_t square_inner_padding = 10;
+
+uint32_t surface_width;
+uint32_t surface_height;
+
+pixman_color_t background_colour;
+pixman_color_t border_colour;
+
+pixman_color_t active_square_background_colour;
+pixman_color_t active_square_occupied_colour;
+pixman_color_t active_square_border_colour;
+
+pixman_color_t inactive_square_background_colour;
+pixman_color_t inactive_square_border_colour;
+pixman_color_t inactive_square_occupied_colour;
+
+pixman_color_t urgent_square_background_colour;
+pixman_color_t urgent_square_border_colour;
+pixman_color_t urgent_square_occupied_colour;
+
+struct wl_list atlases;
+struct wl_list layouts;
+
+_Thread_local uint64_t pixels_written = 0;
+
+/************
+ *          *
+ *  Config  *
+ *          *
+ ************/
+bool colour_from_hex (pixman_color_t *colour, const char *hex)
+{
+	uint16_t r = 0, g = 0, b = 0, a = 255;
+
+	if ( 4 != sscanf(hex, "0x%02hx%02hx%02hx%02hx", &r, &g, &b, &a)
+			&& 3 != sscanf(hex, "0x%02hx%02hx%02hx", &r, &g, &b) )
+	{
+		fprintf(stderr, "ERROR: Invalid colour: %s\n", hex);
+		return false;
+	}
+
+	colour->alpha = (uint16_t)(((double)a / 255.0) * 65535.0);
+	colour->red   = (uint16_t)((((double)r / 255.0) * 65535.0) * colour->alpha / 0xffff);
+	colour->green = (uint16_t)((((double)g / 255.0) * 65535.0) * colour->alpha / 0xffff);
+	colour->blue  = (uint16_t)((((double)b / 255.0) * 65535.0) * colour->alpha / 0xffff);
+
+	return true;
+}
+
+void default_colours (void)
+{
+	colour_from_hex(&background_colour, "0x666666");
+	colour_from_hex(&border_colour, "0x333333");
+
+	colour_from_hex(&active_square_background_colour, "0xE6803A");
+	colour_from_hex(&active_square_border_colour, "0xB24C21");
+	colour_from_hex(&active_square_occupied_colour, "0xFFB277");
+
+	colour_from_hex(&inactive_square_background_colour, "0x999999");
+	colour_from_hex(&inactive_square_border_colour, "0x7F7F7F");
+	colour_from_hex(&inactive_square_occupied_colour, "0xCCCCCC");
+
+	colour_from_hex(&urgent_square_background_colour, "0xEA2113");
+	colour_from_hex(&urgent_square_border_colour, "0xC11414");
+	colour_from_hex(&urgent_square_occupied_colour, "0xFF6B56");
+}
+
+void compute_surface_size (void)
+{
+	surface_width = (tag_amount * (square_size + square_padding)) + square_padding + (2 * border_width);
+	surface_height = square_size + (2 * square_padding) + (2 * border_width);
+}
+
+/***********
+ *         *
+ *  Atlas  *
+ *         *
+ ***********/
+/* Scales are in 120ths, like wp_fractional_scale_v1 uses them. */
+uint32_t scale_length (uint32_t length, uint32_t scale)
+{
+	return (length * scale + 60) / 120;
+}
+
+/* Draws a rectangle with a border; all values are in buffer pixels. */
+static void bordered_rectangle (pixman_image_t *image, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint32_t border,
+		pixman_color_t *background_colour, pixman_color_t *border_colour)
+{
+	pixels_written += (uint64_t)width * height
+		+ 2 * (uint64_t)width * border
+		+ 2 * (uint64_t)(height - 2 * border) * border;
+
+	pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, background_colour,
+			1, &(pixman_rectangle16_t){
+				(int16_t)x,
+				(int16_t)y,
+				(uint16_t)width,
+				(uint16_t)height,
+			});
+
+	pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, border_colour,
+			4, (pixman_rectangle16_t[]){
+				/* Top */
+				{
+					(int16_t)x,
+					(int16_t)y,
+					(uint16_t)width,
+					(uint16_t)border,
+				},
+
+				/* Bottom */
+				{
+					(int16_t)x,
+					(int16_t)(y + height - border),
+					(uint16_t)width,
+					(uint16_t)border,
+				},
+
+				/* Left */
+				{
+					(int16_t)x,
+					(int16_t)(y + border),
+					(uint16_t)border,
+					(uint16_t)(height - 2 * border),
+				},
+
+				/* Right */
+				{
+					(int16_t)(x + width - border),
+					(int16_t)(y + border),
+					(uint16_t)border,
+					(uint16_t)(height - 2 * border),
+				},
+			});
+}
+
+void square_colours (enum Square_state state, pixman_color_t **background,
+		pixman_color_t **border, pixman_color_t **occupied)
+{
+	switch (state)
+	{
+		case SQUARE_ACTIVE:
+			*background = &active_square_background_colour;
+			*border     = &active_square_border_colour;
+			*occupied   = &active_square_occupied_colour;
+			break;
+
+		case SQUARE_URGENT:
+			*background = &urgent_square_background_colour;
+			*border     = &urgent_square_border_colour;
+			*occupied   = &urgent_square_occupied_colour;
+			break;
+
+		default:
+			*background = &inactive_square_background_colour;
+			*border     = &inactive_square_border_colour;
+			*occupied   = &inactive_square_occupied_colour;
+			break;
+	}
+}
+
+void destroy_atlas (struct Atlas *atlas)
+{
+	if ( atlas->pixman_image != NULL )
+		pixman_image_unref(atlas->pixman_image);
+	wl_list_remove(&atlas->link);
+	free(atlas);
+}
+
+static struct Atlas *create_atlas (uint32_t scale)
+{
+	struct Atlas *atlas = calloc(1, sizeof(struct Atlas));
+	if ( atlas == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
+		return NULL;
+	}
+	wl_list_insert(&atlases, &atlas->link);
+	atlas->scale = scale;
+
+	/* All sprites are scaled as a whole, so at fractional scales they are
+	 * still identical apart from their colours.
+	 */
+	const uint32_t size = scale_length(square_size, scale);
+	const uint32_t border_size = scale_length(square_border_width, scale);
+	const uint32_t inner_padding = scale_length(square_inner_padding, scale);
+
+	atlas->pixman_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+			(int32_t)(2 * SQUARE_STATE_AMOUNT * size), (int32_t)size, NULL, 0);
+	if ( atlas->pixman_image == NULL )
+	{
+		destroy_atlas(atlas);
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < 2 * SQUARE_STATE_AMOUNT; i++)
+	{
+		pixman_color_t *background, *border, *occupied;
+		square_colours((enum Square_state)(i % SQUARE_STATE_AMOUNT),
+				&background, &border, &occupied);
+
+		const uint32_t x = i * size;
+
+		bordered_rectangle(atlas->pixman_image, x, 0,
+				size, size, border_size,
+				background, border);
+
+		if ( i >= SQUARE_STATE_AMOUNT )
+			bordered_rectangle(atlas->pixman_image,
+					x + inner_padding, inner_padding,
+					size - 2 * inner_padding,
+					size - 2 * inner_padding,
+					border_size, occupied, border);
+	}
+
+	return atlas;
+}
+
+/* Colours and sizes are fixed at startup, so atlases only ever need to be
+ * rendered for a scale that has not been seen yet.
+ */
+struct Atlas *get_atlas (uint32_t scale)
+{
+	struct Atlas *atlas;
+	wl_list_for_each(atlas, &atlases, link)
+		if ( atlas->scale == scale )
+			return atlas;
+	return create_atlas(scale);
+}
+
+void destroy_atlases (void)
+{
+	struct Atlas *atlas, *tmp;
+	wl_list_for_each_safe(atlas, tmp, &atlases, link)
+		destroy_atlas(atlas);
+}
+
+/***********
+ *         *
+ *  Frame  *
+ *         *
+ ***********/
+/* Returns the index of the atlas sprite for the tag. */
+uint32_t tag_sprite (struct Tags *tags, uint32_t tag)
+{
+	uint32_t sprite;
+	if ( tags->focused & 1 << tag )
+		sprite = SQUARE_ACTIVE;
+	else if ( tags->urgent & 1 << tag )
+		sprite = SQUARE_URGENT;
+	else
+		sprite = SQUARE_INACTIVE;
+
+	if ( tags->view & 1 << tag )
+		sprite += SQUARE_STATE_AMOUNT;
+
+	return sprite;
+}
+
+/* Position of the square of the tag in buffer pixels. */
+void square_position (uint32_t tag, uint32_t scale, uint32_t *x, uint32_t *y)
+{
+	*x = scale_length(border_width + ((tag+1) * square_padding) + (tag * square_size), scale);
+	*y = scale_length(border_width + square_padding, scale);
+}
+
+/* Draws the pop-up for the tags with pixman, into an image of the size of
+ * the surface at the scale of the atlas. If drawn is not NULL, the image
+ * already shows that state and only the squares that differ from it are
+ * redrawn. Every square is copied from the atlas as a whole, replacing
+ * whatever the image held there before, and tag labels are drawn over
+ * it. Must match draw_frame_reference().
+ */
+bool draw_frame_pixman (pixman_image_t *image, struct Atlas *atlas,
+		struct Tags *tags, struct Tags *drawn)
+{
+	const uint32_t scale = atlas->scale;
+
+	if ( drawn == NULL )
+		bordered_rectangle(image, 0, 0,
+				(uint32_t)pixman_image_get_width(image),
+				(uint32_t)pixman_image_get_height(image),
+				scale_length(border_width, scale),
+				&background_colour, &border_colour);
+
+	const uint32_t size = scale_length(square_size, scale);
+	for (uint32_t i = 0; i < tag_amount; i++)
+	{
+		const uint32_t sprite = tag_sprite(tags, i);
+		if ( drawn != NULL && sprite == tag_sprite(drawn, i) )
+			continue;
+
+		uint32_t x, y;
+		square_position(i, scale, &x, &y);
+		pixels_written += (uint64_t)size * size;
+		pixman_image_composite32(PIXMAN_OP_SRC, atlas->pixman_image, NULL, image,
+				(int32_t)(sprite * size), 0, 0, 0,
+				(int32_t)x, (int32_t)y,
+				(int32_t)size, (int32_t)size);
+	}
+
+	return draw_labels(image, scale, tags, drawn);
+}
+
+/* Length in buffer pixels, rounded half up. Worked out on its own rather
+ * than with scale_length(), so that a mistake there shows up in "make
+ * check" instead of in the reference images.
+ */
+static uint32_t reference_length (uint32_t length, uint32_t scale)
+{
+	return (uint32_t)((double)length * (double)scale / 120.0 + 0.5);
+}
+
+/* Whether the pixel at x, y of a rectangle of the given size lies in its
+ * border.
+ */
+static bool reference_in_border (uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t border)
+{
+	return x < border || y < border || x + border >= width || y + border >= height;
+}
+
+/* Colour of a single pixel of the pop-up, from the layout numbers. Later
+ * squares are drawn over earlier ones, like the renderers do.
+ */
+static pixman_color_t *reference_pixel (uint32_t x, uint32_t y, uint32_t width,
+		uint32_t height, uint32_t scale, struct Tags *tags)
+{
+	pixman_color_t *colour = reference_in_border(x, y, width, height, reference_length(border_width, scale))
+		? &border_colour : &background_colour;
+
+	const uint32_t size = reference_length(square_size, scale);
+	const uint32_t edge = reference_length(square_border_width, scale);
+	const uint32_t inner = reference_length(square_inner_padding, scale);
+	const uint32_t square_y = reference_length(border_width + square_padding, scale);
+	for (uint32_t i = 0; i < tag_amount; i++)
+	{
+		const uint32_t square_x = reference_length(border_width
+				+ (i + 1) * square_padding + i * square_size, scale);
+		if ( x < square_x || x >= square_x + size || y < square_y || y >= square_y + size )
+			continue;
+
+		const uint32_t bit = 1u << i;
+		pixman_color_t *background, *border, *occupied;
+		if ( tags->focused & bit )
+		{
+			background = &active_square_background_colour;
+			border = &active_square_border_colour;
+			occupied = &active_square_occupied_colour;
+		}
+		else if ( tags->urgent & bit )
+		{
+			background = &urgent_square_background_colour;
+			border = &urgent_square_border_colour;
+			occupied = &urgent_square_occupied_colour;
+		}
+		else
+		{
+			background = &inactive_square_background_colour;
+			border = &inactive_square_border_colour;
+			occupied = &inactive_square_occupied_colour;
+		}
+
+		const uint32_t sx = x - square_x, sy = y - square_y;
+		colour = reference_in_border(sx, sy, size, size, edge) ? border : background;
+
+		/* The occupied indicator has the border of the square too. */
+		if ( tags->view & bit && sx >= inner && sx + inner < size
+				&& sy >= inner && sy + inner < size )
+			colour = reference_in_border(sx - inner, sy - inner, size - 2 * inner,
+					size - 2 * inner, edge) ? border : occupied;
+	}
+
+	return colour;
+}
+
+/* Draws the whole pop-up for the tags by working out the colour of every
+ * pixel on its own, straight from the layout numbers, without the
+ * geometry helpers, fills, atlases or spans of the other renderers. It is
+ * slow, but simple enough to trust. The reference images of "make check"
+ * are drawn with it, and draw_frame_pixman() and draw_frame() must match
+ * it byte for byte. Only the conversion of colours to pixels is left to
+ * pixman, with runs of equal pixels filled one row at a time. Tag labels
+ * are drawn by draw_labels(), like in the other renderers.
+ */
+bool draw_frame_reference (pixman_image_t *image, uint32_t scale, struct Tags *tags)
+{
+	const uint32_t width = (uint32_t)pixman_image_get_width(image);
+	const uint32_t height = (uint32_t)pixman_image_get_height(image);
+	for (uint32_t y = 0; y < height; y++)
+	{
+		uint32_t x = 0;
+		while ( x < width )
+		{
+			pixman_color_t *colour = reference_pixel(x, y, width, height, scale, tags);
+			uint32_t end = x + 1;
+			while ( end < width && reference_pixel(end, y, width, height, scale, tags) == colour )
+				end++;
+			pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, colour,
+					1, &(pixman_rectangle16_t){
+						(int16_t)x,
+						(int16_t)y,
+						(uint16_t)(end - x),
+						1,
+					});
+			x = end;
+		}
+	}
+
+	return draw_labels(image, scale, tags, NULL);
+}
+
+/***********
+ *         *
+ *  Spans  *
+ *         *
+ ***********/
+/* Same conversion as pixman uses when filling with a colour. */
+uint32_t colour_to_pixel (const pixman_color_t *colour)
+{
+	return (uint32_t)(colour->alpha >> 8) << 24
+		| (uint32_t)(colour->red >> 8) << 16
+		| (uint32_t)(colour->green & 0xff00)
+		| (uint32_t)(colour->blue >> 8);
+}
+
+/* Kernels fill size bytes with a repeated 32 bit pattern. For 16 bit
+ * pixels the pattern holds the pixel twice, so stores need only be aligned
+ * to the pixel size.
+ */
+static void fill_scalar (uint8_t *dst, size_t size, uint32_t pattern)
+{
+	for (; size >= 4; dst += 4, size -= 4)
+		memcpy(dst, &pattern, 4);
+	memcpy(dst, &pattern, size);
+}
+
+#if HAVE_X86
+/* Both vector kernels store the unaligned head and tail with overlapping
+ * stores and everything in between aligned.
+ */
+__attribute__((target("sse2")))
+static void fill_sse2 (uint8_t *dst, size_t size, uint32_t pattern)
+{
+	if ( size < 16 )
+	{
+		fill_scalar(dst, size, pattern);
+		return;
+	}
+
+	const __m128i v = _mm_set1_epi32((int32_t)pattern);
+	uint8_t *end = dst + size;
+	_mm_storeu_si128((__m128i *)dst, v);
+	for (uint8_t *p = (uint8_t *)(((uintptr_t)dst + 16) & ~(uintptr_t)15); p + 16 <= end; p += 16)
+		_mm_store_si128((__m128i *)p, v);
+	_mm_storeu_si128((__m128i *)(end - 16), v);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2 (uint8_t *dst, size_t size, uint32_t pattern)
+{
+	if ( size < 32 )
+	{
+		fill_sse2(dst, size, pattern);
+		return;
+	}
+
+	const __m256i v = _mm256_set1_epi32((int32_t)pattern);
+	uint8_t *end = dst + size;
+	_mm256_storeu_si256((__m256i *)dst, v);
+	for (uint8_t *p = (uint8_t *)(((uintptr_t)dst + 32) & ~(uintptr_t)31); p + 32 <= end; p += 32)
+		_mm256_store_si256((__m256i *)p, v);
+	_mm256_storeu_si256((__m256i *)(end - 32), v);
+}
+#endif
+
+struct Span_kernel
+{
+	const char *name;
+	void (*fill)(uint8_t *dst, size_t size, uint32_t pattern);
+};
+
+/* Best first. */
+static const struct Span_kernel span_kernels[] = {
+#if HAVE_X86
+	{ "avx2",   fill_avx2   },
+	{ "sse2",   fill_sse2   },
+#endif
+	{ "scalar", fill_scalar },
+};
+
+static const struct Span_kernel *span_kernel = NULL;
+
+static bool span_kernel_supported (const struct Span_kernel *kernel)
+{
+#if HAVE_X86
+	if ( kernel->fill == fill_avx2 )
+		return __builtin_cpu_supports("avx2");
+	if ( kernel->fill == fill_sse2 )
+		return __builtin_cpu_supports("sse2");
+#endif
+	return true;
+}
+
+/* Selects the kernel by name, or the best one the CPU supports if name is
+ * NULL.
+ */
+bool select_span_kernel (const char *name)
+{
+	for (size_t i = 0; i < sizeof(span_kernels) / sizeof(span_kernels[0]); i++)
+	{
+		if ( name != NULL && strcmp(span_kernels[i].name, name) != 0 )
+			continue;
+		if (! span_kernel_supported(&span_kernels[i]))
+			continue;
+		span_kernel = &span_kernels[i];
+		return true;
+	}
+	return false;
+}
+
+const char *span_kernel_name (void)
+{
+	if ( span_kernel == NULL )
+		select_span_kernel(NULL);
+	return span_kernel->name;
+}
+
+/* Horizontal run of pixels of one colour, from x up to end. */
+struct Span
+{
+	uint32_t x, end;
+	uint32_t pixel;
+};
+
+/* The background with its borders and every square can add a span for
+ * each of their edges, plus one for the background between squares.
+ */
+#define SPAN_MAX (3 + 8 * 32)
+
+struct Span_list
+{
+	struct Span spans[SPAN_MAX];
+	size_t length;
+};
+
+static void add_span (struct Span_list *list, uint32_t x, uint32_t end, uint32_t pixel)
+{
+	if ( x >= end )
+		return;
+
+	struct Span *last = list->length > 0 ? &list->spans[list->length - 1] : NULL;
+	if ( last != NULL && last->end == x && last->pixel == pixel )
+		last->end = end;
+	else
+		list->spans[list->length++] = (struct Span){ x, end, pixel };
+}
+
+/* Sorted cut positions; the pixel colour only changes at cuts. */
+struct Cuts
+{
+	int64_t cuts[12];
+	size_t length;
+};
+
+static void add_cut (struct Cuts *cuts, int64_t cut, int64_t min, int64_t max)
+{
+	cut = cut < min ? min : cut > max ? max : cut;
+	size_t i = cuts->length++;
+	for (; i > 0 && cuts->cuts[i - 1] > cut; i--)
+		cuts->cuts[i] = cuts->cuts[i - 1];
+	cuts->cuts[i] = cut;
+}
+
+/* Rows of a square that look the same, from y to end relative to its top,
+ * with the spans of every sprite relative to its left edge.
+ */
+#define SPRITE_AMOUNT (2 * SQUARE_STATE_AMOUNT)
+struct Square_band
+{
+	int64_t y, end;
+	struct Span spans[SPRITE_AMOUNT][7];
+	size_t span_amount[SPRITE_AMOUNT];
+};
+
+/* Rows of the pop-up that look the same for any tags. */
+struct Band
+{
+	int64_t y, end;
+
+	/* The rows of the squares these rows are in, NULL outside of them. */
+	struct Square_band *square_band;
+};
+
+/* Geometry of the pop-up at one scale, in buffer pixels, and the spans it
+ * is drawn from. Computed once and kept in layouts; it depends on the
+ * sizes and colours, so destroy_layouts() must be called when they change.
+ */
+struct Layout
+{
+	struct wl_list link;
+	uint32_t scale, tag_amount;
+
+	int64_t width, height, border;
+	int64_t square_y, size, square_border, inner_padding;
+	int64_t square_x[32];
+
+	/* Where a square ends; a square overlapping the next one is cut
+	 * short, as the next one is drawn over it.
+	 */
+	int64_t square_end[32];
+
+	uint32_t background, border_pixel;
+
+	struct Square_band square_bands[7];
+	size_t square_band_amount;
+	struct Band bands[11];
+	size_t band_amount;
+};
+
+/* Whether a pixel at x, y relative to a bordered rectangle of the given
+ * size is part of its border.
+ */
+static bool in_border (int64_t x, int64_t y, int64_t width, int64_t height, int64_t border)
+{
+	return x < border || x >= width - border || y < border || y >= height - border;
+}
+
+/* Colour of a pixel relative to a square, matching the sprites of the
+ * atlas: the occupied indicator is drawn over the square.
+ */
+static uint32_t square_pixel (struct Layout *layout, int64_t x, int64_t y, uint32_t sprite)
+{
+	pixman_color_t *background, *border, *occupied;
+	square_colours((enum Square_state)(sprite % SQUARE_STATE_AMOUNT),
+			&background, &border, &occupied);
+
+	const int64_t inner = layout->inner_padding;
+	const int64_t inner_size = layout->size - 2 * inner;
+	if ( sprite >= SQUARE_STATE_AMOUNT
+			&& x >= inner && x < inner + inner_size
+			&& y >= inner && y < inner + inner_size )
+		return colour_to_pixel(in_border(x - inner, y - inner, inner_size, inner_size,
+					layout->square_border) ? border : occupied);
+
+	return colour_to_pixel(in_border(x, y, layout->size, layout->size,
+				layout->square_border) ? border : background);
+}
+
+/* Adds the spans of row y of a square, from the pixel x relative to the
+ * square on, placed at offset in the image.
+ */
+static void add_square_spans (struct Span_list *list, struct Layout *layout,
+		int64_t offset, int64_t x, int64_t end, int64_t y, uint32_t sprite)
+{
+	const int64_t size = layout->size;
+	const int64_t border = layout->square_border;
+	const int64_t inner = layout->inner_padding;
+
+	struct Cuts cuts = { .length = 0 };
+	add_cut(&cuts, x, x, end);
+	add_cut(&cuts, border, x, end);
+	add_cut(&cuts, size - border, x, end);
+	add_cut(&cuts, end, x, end);
+	if ( sprite >= SQUARE_STATE_AMOUNT )
+	{
+		add_cut(&cuts, inner, x, end);
+		add_cut(&cuts, inner + border, x, end);
+		add_cut(&cuts, size - inner - border, x, end);
+		add_cut(&cuts, size - inner, x, end);
+	}
+
+	for (size_t i = 0; i + 1 < cuts.length; i++)
+		add_span(list, (uint32_t)(offset + cuts.cuts[i]), (uint32_t)(offset + cuts.cuts[i + 1]),
+				square_pixel(layout, cuts.cuts[i], y, sprite));
+}
+
+/* Adds the spans of the background and its border between x and end in
+ * row y.
+ */
+static void add_background_spans (struct Span_list *list, struct Layout *layout,
+		int64_t x, int64_t end, int64_t y)
+{
+	struct Cuts cuts = { .length = 0 };
+	add_cut(&cuts, x, x, end);
+	add_cut(&cuts, layout->border, x, end);
+	add_cut(&cuts, layout->width - layout->border, x, end);
+	add_cut(&cuts, end, x, end);
+
+	for (size_t i = 0; i + 1 < cuts.length; i++)
+		add_span(list, (uint32_t)cuts.cuts[i], (uint32_t)cuts.cuts[i + 1],
+				in_border(cuts.cuts[i], y, layout->width, layout->height, layout->border)
+				? layout->border_pixel : layout->background);
+}
+
+/* Splits the squares into bands of rows and records the spans of every
+ * sprite in each of them.
+ */
+static void compute_square_bands (struct Layout *layout)
+{
+	const int64_t size = layout->size;
+	const int64_t border = layout->square_border;
+	const int64_t inner = layout->inner_padding;
+	struct Cuts cuts = { .length = 0 };
+	add_cut(&cuts, 0, 0, size);
+	add_cut(&cuts, border, 0, size);
+	add_cut(&cuts, inner, 0, size);
+	add_cut(&cuts, inner + border, 0, size);
+	add_cut(&cuts, size - inner - border, 0, size);
+	add_cut(&cuts, size - inner, 0, size);
+	add_cut(&cuts, size - border, 0, size);
+	add_cut(&cuts, size, 0, size);
+
+	layout->square_band_amount = 0;
+	for (size_t i = 0; i + 1 < cuts.length; i++)
+	{
+		if ( cuts.cuts[i] == cuts.cuts[i + 1] )
+			continue;
+
+		struct Square_band *band = &layout->square_bands[layout->square_band_amount++];
+		band->y = cuts.cuts[i];
+		band->end = cuts.cuts[i + 1];
+		for (uint32_t sprite = 0; sprite < SPRITE_AMOUNT; sprite++)
+		{
+			struct Span_list list = { .length = 0 };
+			add_square_spans(&list, layout, 0, 0, size, band->y, sprite);
+			memcpy(band->spans[sprite], list.spans, list.length * sizeof(struct Span));
+			band->span_amount[sprite] = list.length;
+		}
+	}
+}
+
+/* Splits the pop-up into bands of rows that look the same for any tags. */
+static void compute_bands (struct Layout *layout)
+{
+	const int64_t height = layout->height;
+	struct Cuts cuts = { .length = 0 };
+	add_cut(&cuts, 0, 0, height);
+	add_cut(&cuts, layout->border, 0, height);
+	add_cut(&cuts, height - layout->border, 0, height);
+	add_cut(&cuts, height, 0, height);
+	for (size_t i = 0; i < layout->square_band_amount; i++)
+		add_cut(&cuts, layout->square_y + layout->square_bands[i].y, 0, height);
+	add_cut(&cuts, layout->square_y + layout->size, 0, height);
+
+	layout->band_amount = 0;
+	for (size_t i = 0; i + 1 < cuts.length; i++)
+	{
+		if ( cuts.cuts[i] == cuts.cuts[i + 1] )
+			continue;
+
+		struct Band *band = &layout->bands[layout->band_amount++];
+		band->y = cuts.cuts[i];
+		band->end = cuts.cuts[i + 1];
+		band->square_band = NULL;
+		for (size_t j = 0; j < layout->square_band_amount; j++)
+			if ( band->y >= layout->square_y + layout->square_bands[j].y
+					&& band->y < layout->square_y + layout->square_bands[j].end )
+				band->square_band = &layout->square_bands[j];
+	}
+}
+
+static struct Layout *create_layout (uint32_t width, uint32_t height, uint32_t scale)
+{
+	struct Layout *layout = calloc(1, sizeof(struct Layout));
+	if ( layout == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
+		return NULL;
+	}
+
+	layout->scale = scale;
+	layout->tag_amount = tag_amount;
+	layout->width = width;
+	layout->height = height;
+	layout->border = scale_length(border_width, scale);
+	layout->size = scale_length(square_size, scale);
+	layout->square_border = scale_length(square_border_width, scale);
+	layout->inner_padding = scale_length(square_inner_padding, scale);
+	layout->background = colour_to_pixel(&background_colour);
+	layout->border_pixel = colour_to_pixel(&border_colour);
+
+	for (uint32_t i = 0; i < tag_amount; i++)
+	{
+		uint32_t x, y;
+		square_position(i, scale, &x, &y);
+		layout->square_x[i] = x;
+		layout->square_y = y;
+	}
+	for (uint32_t i = 0; i < tag_amount; i++)
+	{
+		layout->square_end[i] = layout->square_x[i] + layout->size;
+		if ( i + 1 < tag_amount && layout->square_end[i] > layout->square_x[i + 1] )
+			layout->square_end[i] = layout->square_x[i + 1];
+		if ( layout->square_end[i] > width )
+			layout->square_end[i] = width;
+	}
+
+	compute_square_bands(layout);
+	compute_bands(layout);
+	return layout;
+}
+
+void destroy_layouts (void)
+{
+	struct Layout *layout, *tmp;
+	wl_list_for_each_safe(layout, tmp, &layouts, link)
+	{
+		wl_list_remove(&layout->link);
+		free(layout);
+	}
+}
+
+static struct Layout *get_layout (uint32_t width, uint32_t height, uint32_t scale)
+{
+	struct Layout *layout;
+	wl_list_for_each(layout, &layouts, link)
+		if ( layout->scale == scale && layout->tag_amount == tag_amount
+				&& layout->width == width && layout->height == height )
+			return layout;
+
+	layout = create_layout(width, height, scale);
+	if ( layout == NULL )
+		return NULL;
+	wl_list_insert(&layouts, &layout->link);
+	return layout;
+}
+
+/* Computes the final spans of the rows of a band, so every pixel is written
+ * once. If drawn is not NULL, only squares that differ from it are included.
+ */
+static void row_spans (struct Span_list *list, struct Layout *layout, struct Band *band,
+		struct Tags *tags, struct Tags *drawn)
+{
+	list->length = 0;
+
+	const struct Square_band *square_band = band->square_band;
+	int64_t x = 0;
+	for (uint32_t i = 0; square_band != NULL && i < tag_amount; i++)
+	{
+		const int64_t square_x = layout->square_x[i];
+		const int64_t start = square_x > x ? square_x : x;
+		const uint32_t sprite = tag_sprite(tags, i);
+		if ( drawn == NULL )
+			add_background_spans(list, layout, x, start, band->y);
+		if ( drawn == NULL || sprite != tag_sprite(drawn, i) )
+			for (size_t j = 0; j < square_band->span_amount[sprite]; j++)
+			{
+				const struct Span *span = &square_band->spans[sprite][j];
+				int64_t span_x = square_x + span->x;
+				int64_t span_end = square_x + span->end;
+				if ( span_x < start )
+					span_x = start;
+				if ( span_end > layout->square_end[i] )
+					span_end = layout->square_end[i];
+				if ( span_x < span_end )
+					add_span(list, (uint32_t)span_x, (uint32_t)span_end, span->pixel);
+			}
+		if ( x < layout->square_end[i] )
+			x = layout->square_end[i];
+	}
+	if ( drawn == NULL )
+		add_background_spans(list, layout, x, layout->width, band->y);
+}
+
+/* Returns the pattern filling pixels of the given depth with an a8r8g8b8
+ * pixel, converted like pixman does. 16 bit pixels are r5g6b5.
+ */
+static uint32_t fill_pattern (uint32_t pixel, uint32_t bpp)
+{
+	if ( bpp != 16 )
+		return pixel;
+	const uint32_t rgb565 = ((pixel >> 3) & 0x001f)
+		| ((pixel >> 5) & 0x07e0)
+		| ((pixel >> 8) & 0xf800);
+	return rgb565 | rgb565 << 16;
+}
+
+/* Creates everything draw_frame() needs for the size and scale, after
+ * which frames can be drawn by several threads at once, each into its own
+ * image.
+ */
+bool prepare_frame (uint32_t width, uint32_t height, uint32_t scale)
+{
+	if ( span_kernel == NULL )
+		select_span_kernel(NULL);
+	return get_layout(width, height, scale) != NULL && prepare_labels(scale);
+}
+
+/* Draws the pop-up for the tags into an image of the size of the surface at
+ * the given scale, like draw_frame_pixman(), but without overdraw: rows are
+ * split into bands in which every row looks the same, and each band is
+ * filled from the spans of its first row, which are put together from the
+ * layout for the size and scale. The image must be in a 32 bit
+ * (a|x)8r8g8b8 format or r5g6b5.
+ */
+bool draw_frame (pixman_image_t *image, uint32_t scale,
+		struct Tags *tags, struct Tags *drawn)
+{
+	if ( span_kernel == NULL )
+		select_span_kernel(NULL);
+
+	struct Layout *layout = get_layout((uint32_t)pixman_image_get_width(image),
+			(uint32_t)pixman_image_get_height(image), scale);
+	if ( layout == NULL )
+		return false;
+
+	const uint32_t bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(image));
+	const size_t pixel_size = bpp / 8;
+	uint8_t *data = (uint8_t *)pixman_image_get_data(image);
+	const size_t stride = (size_t)pixman_image_get_stride(image);
+	struct Span_list list;
+	for (size_t i = 0; i < layout->band_amount; i++)
+	{
+		struct Band *band = &layout->bands[i];
+		if ( drawn != NULL && band->square_band == NULL )
+			continue;
+
+		row_spans(&list, layout, band, tags, drawn);
+		uint64_t row_pixels = 0;
+		for (size_t j = 0; j < list.length; j++)
+			row_pixels += list.spans[j].end - list.spans[j].x;
+		pixels_written += row_pixels * (uint64_t)(band->end - band->y);
+
+		for (size_t j = 0; j < list.length; j++)
+			list.spans[j].pixel = fill_pattern(list.spans[j].pixel, bpp);
+
+		for (int64_t y = band->y; y < band->end; y++)
+		{
+			uint8_t *row = data + (size_t)y * stride;
+			for (size_t j = 0; j < list.length; j++)
+				span_kernel->fill(row + list.spans[j].x * pixel_size,
+						(list.spans[j].end - list.spans[j].x) * pixel_size,
+						list.spans[j].pixel);
+		}
+	}
+
+	return draw_labels(image, scale, tags, drawn);
+}
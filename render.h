@@ -0,0 +1,90 @@
+#ifndef RIVER_TAG_OVERLAY_RENDER_H
+#define RIVER_TAG_OVERLAY_RENDER_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-util.h>
+
+struct Tags
+{
+	uint32_t focused, view, urgent;
+};
+
+enum Square_state
+{
+	SQUARE_ACTIVE,
+	SQUARE_URGENT,
+	SQUARE_INACTIVE,
+	SQUARE_STATE_AMOUNT,
+};
+
+/* Pre-rendered tag squares for one scale, laid out horizontally; one for
+ * every state, first empty and then occupied.
+ */
+struct Atlas
+{
+	struct wl_list link;
+	uint32_t scale;
+	pixman_image_t *pixman_image;
+};
+
+extern uint32_t border_width;
+extern uint32_t tag_amount;
+extern uint32_t square_size;
+extern uint32_t square_padding;
+extern uint32_t square_border_width;
+extern uint32_t square_inner_padding;
+
+extern uint32_t surface_width;
+extern uint32_t surface_height;
+
+extern pixman_color_t background_colour;
+extern pixman_color_t border_colour;
+
+extern pixman_color_t active_square_background_colour;
+extern pixman_color_t active_square_occupied_colour;
+extern pixman_color_t active_square_border_colour;
+
+extern pixman_color_t inactive_square_background_colour;
+extern pixman_color_t inactive_square_border_colour;
+extern pixman_color_t inactive_square_occupied_colour;
+
+extern pixman_color_t urgent_square_background_colour;
+extern pixman_color_t urgent_square_border_colour;
+extern pixman_color_t urgent_square_occupied_colour;
+
+extern struct wl_list atlases;
+
+/* Layouts of the span renderer, one per size and scale. */
+extern struct wl_list layouts;
+
+/* Pixels written by the renderers on this thread, for measuring overdraw. */
+extern _Thread_local uint64_t pixels_written;
+
+bool colour_from_hex (pixman_color_t *colour, const char *hex);
+void default_colours (void);
+void compute_surface_size (void);
+void square_colours (enum Square_state state, pixman_color_t **background,
+		pixman_color_t **border, pixman_color_t **occupied);
+
+uint32_t scale_length (uint32_t length, uint32_t scale);
+void destroy_atlas (struct Atlas *atlas);
+void destroy_atlases (void);
+struct Atlas *get_atlas (uint32_t scale);
+
+uint32_t tag_sprite (struct Tags *tags, uint32_t tag);
+void square_position (uint32_t tag, uint32_t scale, uint32_t *x, uint32_t *y);
+bool draw_frame_pixman (pixman_image_t *image, struct Atlas *atlas,
+		struct Tags *tags, struct Tags *drawn);
+bool draw_frame_reference (pixman_image_t *image, uint32_t scale, struct Tags *tags);
+
+uint32_t colour_to_pixel (const pixman_color_t *colour);
+bool select_span_kernel (const char *name);
+const char *span_kernel_name (void);
+void destroy_layouts (void);
+bool prepare_frame (uint32_t width, uint32_t height, uint32_t scale);
+bool draw_frame (pixman_image_t *image, uint32_t scale,
+		struct Tags *tags, struct Tags *drawn);
+
+#endif
@@ -1,20 +1,34 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <getopt.h>
 #include <pixman.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
+#include "alpha-modifier-v1.h"
+#include "fractional-scale-v1.h"
+#include "flight.h"
+#include "histogram.h"
+#include "label.h"
+#include "render.h"
 #include "river-status-unstable-v1.h"
+#include "single-pixel-buffer-v1.h"
+#include "trace.h"
+#include "viewporter.h"
 #include "wlr-layer-shell-unstable-v1.h"
 
 const char usage[] =
@@ -38,27 +52,143 @@ const char usage[] =
 	"   --square-urgent-occupied-colour     <hex>                     Occupied indicator colour of urgent tag squares\n"
 	"   --anchors                           <int>:<int>:<int>:<int>   Directional anchors top, right bottom, left; 1 for on, 0 for off\n"
 	"   --margins                           <int>:<int>:<int>:<int>   Directional margins top, right bottom, left\n"
+	"   --fade-duration                     <int>                     Duration of the fade-out in milliseconds\n"
+	"   --buffers                           <int>                     Amount of shared buffers per surface (1 to 3)\n"
+	"   --stats-file                        <path>                    Write statistics to this file on SIGUSR1 instead of stderr\n"
+	"   --flight-file                       <path>                    Write the recent event trace to this file on SIGUSR2 instead of stderr\n"
+	"   --record                            <path>                    Record received river events to this file for replaying\n"
+	"   --backend                           <auto|shm|subsurface>     How to draw the pop-up (default auto)\n"
+	"   --format                            <name>                    Pixel format: auto, argb8888, xrgb8888 or rgb565 (default auto)\n"
+	"   --tag-labels                        <str>:<str>:...           Labels of the tags, drawn over their squares\n"
+	"   --font                              <name|path>               Font of the tag labels (default monospace:bold)\n"
+	"   --render-threads                    <auto|int>                Threads drawing the pop-ups of all outputs at once (default 1)\n"
+	"   --span-kernel                       <name>                    Span fill kernel: avx2, sse2 or scalar (default the fastest)\n"
+	"   --render-to                         <path>                    Draw one frame into a PPM or PAM file and exit\n"
+	"   --render-tags                       <int>:<int>:<int>         Focused, view and urgent tags of that frame (default 1:1:0)\n"
+	"   --render-from                       <int>:<int>:<int>         Draw that frame as an update of these tags\n"
+	"   --render-scale                      <float>                   Scale of that frame (default 1)\n"
+	"   --renderer                          <name>                    Renderer of that frame: spans, pixman or reference (default spans)\n"
 	"\n";
 
+#define BUFFER_MAX 3
+#define HIDE_DELAY_NSEC 500000000
+#define NSEC_PER_SEC 1000000000
+
+/* Shared memory pool. All cached buffers are slots of a single one. */
+struct Pool
+{
+	int fd;
+	void *mmap;
+	size_t size;
+	struct wl_shm_pool *wl_shm_pool;
+};
+
 struct Buffer
 {
+	struct wl_list link;
+	uint32_t scale;
 	uint32_t width;
 	uint32_t height;
 	uint32_t stride;
+
+	/* Slot of the buffer in buffer_pool. */
+	size_t offset;
 	size_t size;
-	void *mmap;
+
 	struct wl_buffer *wl_buffer;
 	pixman_image_t *pixman_image;
+
+	/* Set from attaching the buffer until the compositor releases it. */
 	bool busy;
+
+	/* Amount of surfaces that have the buffer attached. */
+	uint32_t attachments;
+
+	/* Identifies the buffer in the flight recorder. */
+	uint32_t id;
+
+	/* The tag state the buffer contents show, if drawn is set. When the
+	 * buffer is reused only the squares that differ from it are redrawn.
+	 */
+	struct Tags tags;
+	bool drawn;
+};
+
+/* A solid rectangle of the subsurface backend: a subsurface showing a
+ * single pixel buffer, stretched by its viewport.
+ */
+struct Part
+{
+	struct wl_surface *wl_surface;
+	struct wl_subsurface *subsurface;
+	struct wp_viewport *viewport;
+
+	/* The attached colour buffer, or NULL. */
+	struct wl_buffer *buffer;
+};
+
+/* Parts of a tag square, bottom to top. */
+enum Square_part
+{
+	PART_BORDER,
+	PART_BACKGROUND,
+	PART_OCCUPIED_BORDER,
+	PART_OCCUPIED,
+	PART_AMOUNT,
 };
 
 struct Surface
 {
+	struct Output *output;
 	struct wl_surface *wl_surface;
 	struct zwlr_layer_surface_v1 *layer_surface;
-	struct Buffer buffer[2];
-	struct timespec last_frame;
+	struct wp_viewport *viewport;
+	struct wp_fractional_scale_v1 *fractional_scale;
+	struct wp_alpha_modifier_surface_v1 *alpha_modifier;
+
+	/* With the subsurface backend the pop-up is assembled from parts
+	 * instead of rendered into buffers: the background, then PART_AMOUNT
+	 * parts for every tag. The surface itself shows the border colour.
+	 */
+	struct Part *parts;
+
+	/* The last attached buffer, from the shared buffers. */
+	struct Buffer *current;
+
+	/* Size and tag state of the last attached buffer, used to work out
+	 * damage. The size is zero if no buffer is attached.
+	 */
+	uint32_t width, height;
+	struct Tags tags;
+
+	/* Frames are only rendered when the compositor is ready for them.
+	 * State changes while a frame callback is pending mark the surface
+	 * dirty and are rendered when it is done.
+	 */
+	struct wl_callback *frame_callback;
+	bool dirty;
+
+	/* Set if a frame could not be rendered because all buffers were busy;
+	 * it is rendered as soon as one is released.
+	 */
+	bool render_pending;
+
+	/* While fading out, every frame callback lowers the opacity of the
+	 * pop-up, 255 being fully opaque. Without an alpha modifier the
+	 * attached buffer holds the faded frame, and fade_source holds on to
+	 * the frame from before the fade, which every faded frame is drawn
+	 * from.
+	 */
+	bool fading;
+	uint64_t fade_start;
+	uint32_t alpha;
+	struct Buffer *fade_source;
+
+	/* Whether the opaque region covers the surface. */
+	bool opaque;
+
 	bool configured;
+	bool visible;
 };
 
 struct Output
@@ -68,11 +198,40 @@ struct Output
 	uint32_t global_name;
 	struct Surface *surface;
 	struct zriver_output_status_v1 *river_status;
-	uint32_t focused_tags, view_tags, urgent_tags;
-	uint32_t scale; // TODO
+	struct Tags tags;
+	uint32_t scale;
+
+	/* Preferred scale of the surface in 120ths, if the compositor supports
+	 * fractional scaling, otherwise 0.
+	 */
+	uint32_t fractional_scale;
+
+	/* Set by the status event handlers; the pop-up is updated once all
+	 * events of a dispatch have been handled.
+	 */
+	bool update_pending;
 	bool configured;
+
+	/* Monotonic time in nanoseconds at which the pop-up is hidden and the
+	 * position of the output in the hide heap, or HIDE_NONE if it is not
+	 * scheduled.
+	 */
+	uint64_t hide_deadline;
+	size_t hide_index;
+
+	/* Monotonic time in nanoseconds of the first status event not shown
+	 * yet, or 0.
+	 */
+	uint64_t update_time;
+
+	/* Whether the commit of the pop-up waits for its frame to be drawn
+	 * by the workers.
+	 */
+	bool commit_pending;
 };
 
+#define HIDE_NONE SIZE_MAX
+
 struct Seat
 {
 	struct wl_list link;
@@ -89,20 +248,24 @@ struct wl_registry *wl_registry = NULL;
 struct wl_callback *sync_callback = NULL;
 struct wl_compositor *wl_compositor = NULL;
 struct wl_shm *wl_shm = NULL;
+struct wl_subcompositor *wl_subcompositor = NULL;
+struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager = NULL;
 struct zriver_status_manager_v1 *river_status_manager = NULL;
 struct zwlr_layer_shell_v1 *layer_shell = NULL;
+struct wp_viewporter *viewporter = NULL;
+struct wp_fractional_scale_manager_v1 *fractional_scale_manager = NULL;
+struct wp_alpha_modifier_v1 *alpha_modifier_manager = NULL;
 struct wl_list outputs;
 struct wl_list seats;
 
-uint32_t border_width = 2;
-uint32_t tag_amount = 9;
-uint32_t square_size = 40;
-uint32_t square_padding = 15;
-uint32_t square_border_width = 1;
-uint32_t square_inner_padding = 10;
-
-uint32_t surface_width;
-uint32_t surface_height;
+/* Outputs with a pop-up up, as a binary min-heap ordered by hide deadline.
+ * A single timerfd is armed for the earliest deadline.
+ */
+struct Output **hide_heap = NULL;
+size_t hide_heap_length = 0;
+size_t hide_heap_capacity = 0;
+int timer_fd = -1;
+uint64_t timer_deadline = 0;
 
 enum zwlr_layer_surface_v1_anchor surface_anchors = 0;
 
@@ -111,20 +274,182 @@ uint32_t margin_right = 0;
 uint32_t margin_bottom = 0;
 uint32_t margin_left = 0;
 
-pixman_color_t background_colour;
-pixman_color_t border_colour;
+/* Fade-out duration in nanoseconds, 0 to hide pop-ups right away. */
+uint64_t fade_duration = 0;
+
+/* Constant alpha mask for fading without an alpha modifier, created once;
+ * the alpha is changed by writing to its single pixel.
+ */
+pixman_image_t *fade_mask = NULL;
+uint32_t fade_mask_pixel;
+
+uint32_t buffer_amount = 2;
+
+/* Buffers shared by all pop-ups: outputs showing the same tags at the same
+ * scale attach the same buffer. Everything else that decides the contents
+ * is fixed for the lifetime of the process.
+ */
+struct wl_list buffers;
+uint32_t buffer_count = 0;
+
+/* Holds the cached buffers, so they cost no pool of their own in the
+ * compositor. It only ever grows, and is created with the first buffer.
+ */
+struct Pool buffer_pool;
+uint32_t buffer_ids = 0;
+uint32_t surface_count = 0;
+
+/* A frame for the workers to draw into a buffer. */
+struct Job
+{
+	/* The image is taken from the buffer when drawing, as growing the
+	 * pool re-creates the images of all buffers.
+	 */
+	struct Buffer *buffer;
+	uint32_t scale;
+	struct Tags tags;
+
+	/* What the buffer shows, if partial, so only squares that differ
+	 * are drawn.
+	 */
+	struct Tags drawn;
+	bool partial;
+};
+
+/* Frames of all pop-ups updated after a dispatch are drawn at once by
+ * render_threads threads, the main thread and the workers; the Wayland
+ * requests all stay on the main thread. With one thread there are no
+ * workers and frames are drawn as they are rendered.
+ */
+uint32_t render_threads = 1;
+pthread_t *workers = NULL;
+uint32_t worker_amount = 0;
+bool batching = false;
+struct Job *jobs = NULL;
+size_t job_amount = 0;
+size_t job_capacity = 0;
+
+/* Protects the fields below, which hand the jobs of a batch out. */
+pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobs_posted = PTHREAD_COND_INITIALIZER;
+pthread_cond_t jobs_finished = PTHREAD_COND_INITIALIZER;
+size_t jobs_open = 0;
+size_t jobs_taken = 0;
+size_t jobs_done = 0;
+bool workers_quit = false;
+
+enum Backend
+{
+	BACKEND_AUTO,
+	BACKEND_SHM,
+	BACKEND_SUBSURFACE,
+} backend = BACKEND_AUTO;
+
+/* Pixel formats of shm buffers. Opaque formats let the compositor skip
+ * blending the pop-up, but need all colours to be opaque.
+ */
+struct Format
+{
+	const char *name;
+	enum wl_shm_format shm_format;
+	pixman_format_code_t pixman_format;
+	bool opaque;
+
+	/* Whether wl_shm supports the format. */
+	bool advertised;
+};
+
+enum
+{
+	FORMAT_ARGB8888,
+	FORMAT_XRGB8888,
+	FORMAT_RGB565,
+	FORMAT_AMOUNT,
+};
+
+struct Format formats[FORMAT_AMOUNT] = {
+	[FORMAT_ARGB8888] = { "argb8888", WL_SHM_FORMAT_ARGB8888, PIXMAN_a8r8g8b8, false, false },
+	[FORMAT_XRGB8888] = { "xrgb8888", WL_SHM_FORMAT_XRGB8888, PIXMAN_x8r8g8b8, true,  false },
+	[FORMAT_RGB565]   = { "rgb565",   WL_SHM_FORMAT_RGB565,   PIXMAN_r5g6b5,   true,  false },
+};
+
+/* NULL until chosen once the formats of wl_shm are known, unless set with
+ * --format.
+ */
+struct Format *buffer_format = NULL;
+bool shm_formats_synced = false;
+
+/* Solid colour buffers of the subsurface backend, shared by all pop-ups
+ * and indexed like scene_colours. Without single pixel buffers they are
+ * 1x1 shm buffers in colour_pool.
+ */
+pixman_color_t *const scene_colours[] = {
+	&background_colour,
+	&border_colour,
+	&active_square_background_colour,
+	&active_square_occupied_colour,
+	&active_square_border_colour,
+	&inactive_square_background_colour,
+	&inactive_square_border_colour,
+	&inactive_square_occupied_colour,
+	&urgent_square_background_colour,
+	&urgent_square_border_colour,
+	&urgent_square_occupied_colour,
+};
+#define SCENE_COLOUR_AMOUNT (sizeof(scene_colours) / sizeof(scene_colours[0]))
+struct wl_buffer *colour_buffers[SCENE_COLOUR_AMOUNT];
+struct Pool colour_pool;
+
+/* Runtime statistics, written as JSON on SIGUSR1. They are only ever
+ * incremented, so keeping them costs next to nothing.
+ */
+struct Stats
+{
+	uint64_t focused_tags_events;
+	uint64_t view_tags_events;
+	uint64_t urgent_tags_events;
+	uint64_t focused_output_events;
+
+	uint64_t renders;
+
+	/* Frames shown with a buffer another pop-up rendered. */
+	uint64_t renders_shared;
 
-pixman_color_t active_square_background_colour;
-pixman_color_t active_square_occupied_colour;
-pixman_color_t active_square_border_colour;
+	uint64_t commits;
+	uint64_t buffers_created;
+	uint64_t surfaces_created;
+	uint64_t surfaces_destroyed;
+	uint64_t wakeups;
+
+	/* Backpressure: how often all buffers of a ring were busy, how often
+	 * a ring grew because of it and how many frames could not be rendered
+	 * until a buffer was released.
+	 */
+	uint64_t buffers_exhausted;
+	uint64_t buffer_ring_grown;
+	uint64_t frames_dropped;
+
+	uint64_t fade_frames;
+	uint64_t fade_cpu_nsec;
+
+	/* Nanoseconds from the first status event handler of an update to the
+	 * commit showing it.
+	 */
+	struct Histogram latency;
+} stats;
+
+const char *stats_path = NULL;
+
+/* The last events, written as a Chrome trace on SIGUSR2. Only the main
+ * thread records.
+ */
+struct Flight_recorder flight;
+const char *flight_path = NULL;
 
-pixman_color_t inactive_square_background_colour;
-pixman_color_t inactive_square_border_colour;
-pixman_color_t inactive_square_occupied_colour;
+/* Trace of received events, see trace.h. */
+FILE *record_file = NULL;
+uint64_t record_start = 0;
 
-pixman_color_t urgent_square_background_colour;
-pixman_color_t urgent_square_border_colour;
-pixman_color_t urgent_square_occupied_colour;
 
 
 /************
@@ -132,336 +457,1279 @@ pixman_color_t urgent_square_occupied_colour;
  *  Buffer  *
  *          *
  ************/
-static void randomize_string (char *str, size_t len)
+static void finish_pool (struct Pool *pool)
 {
-	struct timespec ts;
-	clock_gettime(CLOCK_REALTIME, &ts);
-	long r = ts.tv_nsec;
+	if ( pool->wl_shm_pool == NULL )
+		return;
+	wl_shm_pool_destroy(pool->wl_shm_pool);
+	munmap(pool->mmap, pool->size);
+	close(pool->fd);
+	memset(pool, 0, sizeof(struct Pool));
+}
 
-	for (size_t i = 0; i < len; i++, str++)
+static void *map_pool (int fd, size_t size)
+{
+	/* Prefault the pages, they are all going to be written anyway. */
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, 0);
+	if ( mem == MAP_FAILED )
 	{
-		/* Use two byte from the current nano-second to pseudo-randomly
-		 * increase the ASCII character 'A' into another character,
-		 * which will then subsitute the character at *str.
-		 */
-		*str = (char)('A' + (r&15) + (r&16));
-		r >>= 5;
+		fprintf(stderr, "ERROR: mmap: %s.\n", strerror(errno));
+		return NULL;
 	}
+	return mem;
 }
 
-/* Tries to create a shared memory object and returns its file descriptor if
- * successful.
- */
-static bool get_shm_fd (int *fd, size_t size)
+static bool init_pool (struct Pool *pool, size_t size)
 {
-	char name[] = "/river-tag-overlay-RANDOM";
-	char *rp    = name + strlen("/river-tag-overlay-");; /* Pointer to random part. */
-	size_t rl   = strlen("RANDOM"); /* Length of random part. */
+	int fd = memfd_create("river-tag-overlay", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "ERROR: memfd_create: %s.\n", strerror(errno));
+		return false;
+	}
 
-	/* Try a few times to get a unique name. */
-	for (int tries = 100; tries > 0; tries--)
+	if ( ftruncate(fd, (off_t)size) < 0 )
 	{
-		/* Make the name pseudo-random to not conflict with other
-		 * running instances.
-		 */
-		randomize_string(rp, rl);
+		fprintf(stderr, "ERROR: ftruncate: %s.\n", strerror(errno));
+		goto error;
+	}
 
-		/* Try to create a shared memory object. Returns -1 if the
-		 * memory object already exists.
-		 */
-		*fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	/* The pool only ever grows, so the compositor is guaranteed that the
+	 * memory it maps will not be truncated under it.
+	 */
+	if ( fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0 )
+	{
+		fprintf(stderr, "ERROR: fcntl: %s.\n", strerror(errno));
+		goto error;
+	}
 
-		/* If a shared memory object was created, set its size and
-		 * return its file descriptor.
-		 */
-		if ( *fd >= 0 )
-		{
-			shm_unlink(name);
-			if ( ftruncate(*fd, (off_t)size) < 0 )
-			{
-				fprintf(stderr, "ERROR: ftruncate: %s.\n", strerror(errno));
-				close(*fd);
-				return false;
-			}
-			return true;
-		}
+	pool->mmap = map_pool(fd, size);
+	if ( pool->mmap == NULL )
+		goto error;
 
-		/* The EEXIST error means that the name is not unique and we
-		 * must try again.
-		 */
-		if ( errno != EEXIST )
-		{
-			fprintf(stderr, "ERROR: shm_open: %s.\n", strerror(errno));
-			return false;
-		}
+	pool->wl_shm_pool = wl_shm_create_pool(wl_shm, fd, (int32_t)size);
+	if ( pool->wl_shm_pool == NULL )
+	{
+		munmap(pool->mmap, size);
+		goto error;
 	}
 
+	pool->fd = fd;
+	pool->size = size;
+	return true;
+
+error:
+	close(fd);
+	memset(pool, 0, sizeof(struct Pool));
 	return false;
 }
 
+static bool grow_pool (struct Pool *pool, size_t size)
+{
+	if ( ftruncate(pool->fd, (off_t)size) < 0 )
+	{
+		fprintf(stderr, "ERROR: ftruncate: %s.\n", strerror(errno));
+		return false;
+	}
+
+	void *mem = map_pool(pool->fd, size);
+	if ( mem == NULL )
+		return false;
+
+	munmap(pool->mmap, pool->size);
+	pool->mmap = mem;
+	pool->size = size;
+	wl_shm_pool_resize(pool->wl_shm_pool, (int32_t)size);
+
+	return true;
+}
+
+static bool tags_equal (struct Tags *a, struct Tags *b)
+{
+	return a->focused == b->focused && a->view == b->view && a->urgent == b->urgent;
+}
+
+static void commit_frame (struct Output *output);
+
 static void buffer_handle_release (void *data, struct wl_buffer *wl_buffer)
 {
 	struct Buffer *buffer = (struct Buffer *)data;
 	buffer->busy = false;
+	flight_record(&flight, FLIGHT_BUFFER_RELEASE, 0, buffer->id, 0);
+
+	/* Frames were dropped for lack of a buffer; render them now, or with
+	 * the next frame callback if one is pending. Buffers are shared, so
+	 * any pop-up may have been waiting for this one.
+	 */
+	struct Output *output;
+	wl_list_for_each(output, &outputs, link)
+	{
+		struct Surface *surface = output->surface;
+		if ( surface == NULL || ! surface->render_pending )
+			continue;
+		surface->render_pending = false;
+		if ( surface->frame_callback != NULL )
+			surface->dirty = true;
+		else
+			commit_frame(output);
+	}
 }
 
 static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_handle_release,
 };
 
+/* Frees everything but the list link, the count of surfaces the buffer is
+ * attached to and the id, so the buffer can be re-initialised at another
+ * scale.
+ */
 static void finish_buffer (struct Buffer *buffer)
 {
 	if ( buffer->wl_buffer != NULL )
 		wl_buffer_destroy(buffer->wl_buffer);
 	if ( buffer->pixman_image != NULL )
 		pixman_image_unref(buffer->pixman_image);
-	if ( buffer->mmap != NULL )
-		munmap(buffer->mmap, buffer->size);
+
+	struct wl_list link = buffer->link;
+	const uint32_t attachments = buffer->attachments;
+	const uint32_t id = buffer->id;
 	memset(buffer, 0, sizeof(struct Buffer));
+	buffer->link = link;
+	buffer->attachments = attachments;
+	buffer->id = id;
 }
 
-#define PIXMAN_STRIDE(A, B) (((PIXMAN_FORMAT_BPP(A) * B + 7) / 8 + 4 - 1) & -4)
-static bool init_buffer (struct Buffer *buffer, uint32_t width, uint32_t height)
+static bool map_buffer (struct Buffer *buffer)
 {
-	bool ret = true;
-
-	buffer->width  = width;
-	buffer->height = height;
-	buffer->stride = (uint32_t)PIXMAN_STRIDE(PIXMAN_a8r8g8b8, (int32_t)width);
-	buffer->size   = (size_t)(buffer->stride * height);
+	if ( buffer->pixman_image != NULL )
+		pixman_image_unref(buffer->pixman_image);
+	buffer->pixman_image = pixman_image_create_bits_no_clear(buffer_format->pixman_format,
+			(int32_t)buffer->width, (int32_t)buffer->height,
+			(uint32_t *)((char *)buffer_pool.mmap + buffer->offset),
+			(int32_t)buffer->stride);
+	return buffer->pixman_image != NULL;
+}
 
-	if ( buffer->size == 0 )
+/* Returns the lowest offset at which a slot of the given size does not
+ * overlap the slot of any other buffer. Buffers of different scales come
+ * and go, so there may be gaps between the slots.
+ */
+static size_t find_slot (struct Buffer *buffer, size_t size)
+{
+	size_t offset = 0;
+	bool moved = true;
+	while (moved)
 	{
-		ret = false;
-		goto cleanup;
+		moved = false;
+		struct Buffer *other;
+		wl_list_for_each(other, &buffers, link)
+		{
+			if ( other == buffer || other->wl_buffer == NULL )
+				continue;
+			if ( offset < other->offset + other->size
+					&& other->offset < offset + size )
+			{
+				offset = other->offset + other->size;
+				moved = true;
+			}
+		}
 	}
+	return offset;
+}
 
-	int fd = -1;
-	if (! get_shm_fd(&fd, buffer->size))
-	{
-		ret = false;
-		goto cleanup;
-	}
+/* Makes sure the pool has room for the slot of the buffer. The pool at
+ * least doubles when it grows, so a growing cache resizes it rarely. A
+ * grown pool is mapped at a new address, so the images of all buffers are
+ * re-created.
+ */
+static bool reserve_pool (struct Buffer *buffer)
+{
+	const size_t end = buffer->offset + buffer->size;
+	if ( buffer_pool.wl_shm_pool == NULL )
+		return init_pool(&buffer_pool, buffer_amount * end);
+	if ( buffer_pool.size >= end )
+		return true;
 
-	buffer->mmap = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if ( buffer->mmap == MAP_FAILED )
-	{
-		fprintf(stderr, "ERROR: mmap: %s.\n", strerror(errno));
-		ret = false;
-		goto cleanup;
-	}
+	if (! grow_pool(&buffer_pool, end > 2 * buffer_pool.size ? end : 2 * buffer_pool.size))
+		return false;
 
-	struct wl_shm_pool *shm_pool = wl_shm_create_pool(wl_shm, fd, (int32_t)buffer->size);
-	if ( shm_pool == NULL )
-	{
-		ret = false;
-		goto cleanup;
-	}
+	struct Buffer *other;
+	wl_list_for_each(other, &buffers, link)
+		if ( other != buffer && other->pixman_image != NULL && ! map_buffer(other) )
+			return false;
+	return true;
+}
 
-	buffer->wl_buffer = wl_shm_pool_create_buffer(shm_pool, 0, (int32_t)width,
-			(int32_t)height, (int32_t)buffer->stride, WL_SHM_FORMAT_ARGB8888);
+#define PIXMAN_STRIDE(A, B) ((((int32_t)PIXMAN_FORMAT_BPP(A) * B + 7) / 8 + 4 - 1) & -4)
+static bool init_buffer (struct Buffer *buffer, uint32_t scale)
+{
+	const uint32_t width = scale_length(surface_width, scale);
+	const uint32_t height = scale_length(surface_height, scale);
+	buffer->scale  = scale;
+	buffer->width  = width;
+	buffer->height = height;
+	buffer->stride = (uint32_t)PIXMAN_STRIDE(buffer_format->pixman_format, (int32_t)width);
+	buffer->size   = (size_t)buffer->stride * height;
+
+	if ( buffer->size == 0 )
+		goto error;
+
+	buffer->offset = find_slot(buffer, buffer->size);
+	if (! reserve_pool(buffer))
+		goto error;
+
+	buffer->wl_buffer = wl_shm_pool_create_buffer(buffer_pool.wl_shm_pool,
+			(int32_t)buffer->offset, (int32_t)width, (int32_t)height,
+			(int32_t)buffer->stride, buffer_format->shm_format);
 	if ( buffer->wl_buffer == NULL )
-	{
-		ret = false;
-		goto cleanup;
-	}
+		goto error;
 	wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
 
-	buffer->pixman_image = pixman_image_create_bits_no_clear(PIXMAN_a8r8g8b8,
-			(int32_t)width, (int32_t)height, buffer->mmap, (int32_t)buffer->stride);
-	if ( buffer->pixman_image == NULL )
-	{
-		ret = false;
-		goto cleanup;
-	}
+	if (! map_buffer(buffer))
+		goto error;
 
-cleanup:
-	if ( shm_pool != NULL )
-		wl_shm_pool_destroy(shm_pool);
-	if ( fd != -1 )
-		close(fd);
-	if (! ret)
-		finish_buffer(buffer);
+	stats.buffers_created++;
+	return true;
 
-	return ret;
+error:
+	finish_buffer(buffer);
+	return false;
 }
 #undef PIXMAN_STRIDE
 
-static struct Buffer *next_buffer (struct Surface *surface, uint32_t width, uint32_t height)
+static void destroy_buffer (struct Buffer *buffer)
 {
-	int i;
-	if (! surface->buffer[0].busy)
-		i = 0;
-	else if (! surface->buffer[1].busy)
-		i = 1;
-	else
+	finish_buffer(buffer);
+	wl_list_remove(&buffer->link);
+	free(buffer);
+	buffer_count--;
+}
+
+static struct Buffer *create_buffer (uint32_t scale)
+{
+	struct Buffer *buffer = calloc(1, sizeof(struct Buffer));
+	if ( buffer == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
 		return NULL;
+	}
+	wl_list_insert(&buffers, &buffer->link);
+	buffer_count++;
+	buffer->id = ++buffer_ids;
 
-	if ( surface->buffer[i].width != width
-			|| surface->buffer[i].height != height
-			|| surface->buffer[i].wl_buffer == NULL )
+	if (! init_buffer(buffer, scale))
 	{
-		finish_buffer(&surface->buffer[i]);
-		if (! init_buffer(&surface->buffer[i], width, height))
-			return NULL;
+		destroy_buffer(buffer);
+		return NULL;
 	}
+	return buffer;
+}
 
-	return &surface->buffer[i];
+/* Destroys idle buffers no surface shows until at most limit are left. */
+static void trim_buffers (uint32_t limit)
+{
+	struct Buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &buffers, link)
+		if ( buffer_count > limit && ! buffer->busy && buffer->attachments == 0 )
+			destroy_buffer(buffer);
 }
 
-/*************
- *           *
- *  Surface  *
- *           *
- *************/
-static void bordered_rectangle (pixman_image_t *image, uint32_t x, uint32_t y,
-		uint32_t width, uint32_t height, uint32_t border, uint32_t scale,
-		pixman_color_t *background_colour, pixman_color_t *border_colour)
-{
-	x *= scale, y *= scale, width *= scale, height *= scale, border *= scale;
-
-	pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, background_colour,
-			1, &(pixman_rectangle16_t){
-				(int16_t)x,
-				(int16_t)y,
-				(uint16_t)width,
-				(uint16_t)height,
-			});
-
-	pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, border_colour,
-			4, (pixman_rectangle16_t[]){
-				/* Top */
-				{
-					(int16_t)x,
-					(int16_t)y,
-					(uint16_t)width,
-					(uint16_t)border,
-				},
-
-				/* Bottom */
-				{
-					(int16_t)x,
-					(int16_t)(y + height - border),
-					(uint16_t)width,
-					(uint16_t)border,
-				},
-
-				/* Left */
-				{
-					(int16_t)x,
-					(int16_t)(y + border),
-					(uint16_t)border,
-					(uint16_t)(height - 2 * border),
-				},
-
-				/* Right */
-				{
-					(int16_t)(x + width - border),
-					(int16_t)(y + border),
-					(uint16_t)border,
-					(uint16_t)(height - 2 * border),
-				},
-			});
-}
-
-static void render_frame (struct Output *output)
+static void set_current_buffer (struct Surface *surface, struct Buffer *buffer)
 {
-	struct Surface *surface = output->surface;
+	if ( surface->current != NULL )
+		surface->current->attachments--;
+	surface->current = buffer;
+	if ( buffer != NULL )
+		buffer->attachments++;
+}
 
-	if (! surface->configured)
-		return;
+/* The source counts as an attachment, so no surface draws into it. */
+static void set_fade_source (struct Surface *surface, struct Buffer *buffer)
+{
+	if ( surface->fade_source != NULL )
+		surface->fade_source->attachments--;
+	surface->fade_source = buffer;
+	if ( buffer != NULL )
+		buffer->attachments++;
+}
 
-	struct Buffer *buffer = next_buffer(surface,
-			surface_width * output->scale, surface_height * output->scale);
-	if ( buffer == NULL )
-		return;
+/* Returns a buffer that already shows the tags at the scale, or NULL. */
+static struct Buffer *cached_buffer (struct Tags *tags, uint32_t scale)
+{
+	struct Buffer *buffer;
+	wl_list_for_each(buffer, &buffers, link)
+		if ( buffer->drawn && buffer->scale == scale && tags_equal(&buffer->tags, tags) )
+			return buffer;
+	return NULL;
+}
 
-	bordered_rectangle(buffer->pixman_image, 0, 0, buffer->width, buffer->height,
-			border_width, output->scale, &background_colour, &border_colour);
+/* Whether the surface may draw into the buffer: it must be released and
+ * not shown by any other surface, as their fade-out may read it back.
+ */
+static bool buffer_available (struct Buffer *buffer, struct Surface *surface)
+{
+	return ! buffer->busy && ( buffer->attachments == 0
+			|| ( buffer->attachments == 1 && surface->current == buffer ) );
+}
 
-	/* Tags. */
-	#define TAG_ON(A, B) ( A & 1 << B )
-	for (uint32_t i = 0; i < tag_amount; i++)
+/* Returns a buffer at the given scale the surface can draw into. Buffers
+ * no surface shows are preferred, then a buffer at a scale no longer in
+ * use is re-initialised. Only buffers no surface shows, not even this one,
+ * are re-initialised, as a surface may still read back its current buffer. The cache grows to buffer_amount buffers per
+ * surface, and up to BUFFER_MAX per surface if the compositor holds on to
+ * them.
+ */
+static struct Buffer *next_buffer (struct Surface *surface, uint32_t scale)
+{
+	struct Buffer *buffer, *found = NULL, *other_scale = NULL;
+	wl_list_for_each(buffer, &buffers, link)
 	{
-		pixman_color_t *square_background_colour;
-		pixman_color_t *square_border_colour;
-		pixman_color_t *square_occupied_colour;
-		if (TAG_ON(output->focused_tags, i))
-		{
-			square_background_colour = &active_square_background_colour;
-			square_border_colour     = &active_square_border_colour;
-			square_occupied_colour   = &active_square_occupied_colour;
-		}
-		else if (TAG_ON(output->urgent_tags, i))
+		if (! buffer_available(buffer, surface))
+			continue;
+		if ( buffer->scale != scale )
 		{
-			square_background_colour = &urgent_square_background_colour;
-			square_border_colour     = &urgent_square_border_colour;
-			square_occupied_colour   = &urgent_square_occupied_colour;
+			if ( buffer->attachments == 0 )
+				other_scale = buffer;
 		}
-		else
+		else if ( found == NULL || buffer->attachments == 0 )
+			found = buffer;
+	}
+	const uint32_t name = surface->output->global_name;
+	if ( found != NULL )
+	{
+		flight_record(&flight, FLIGHT_NEXT_BUFFER, name, FLIGHT_BUFFER_FREE, found->id);
+		return found;
+	}
+
+	if ( other_scale != NULL )
+	{
+		finish_buffer(other_scale);
+		if (! init_buffer(other_scale, scale))
 		{
-			square_background_colour = &inactive_square_background_colour;
-			square_border_colour     = &inactive_square_border_colour;
-			square_occupied_colour   = &inactive_square_occupied_colour;
+			flight_record(&flight, FLIGHT_NEXT_BUFFER, name, FLIGHT_BUFFER_NONE, 0);
+			return NULL;
 		}
+		flight_record(&flight, FLIGHT_NEXT_BUFFER, name, FLIGHT_BUFFER_RESCALED, other_scale->id);
+		return other_scale;
+	}
 
-		const uint32_t x = border_width + ((i+1) * square_padding) + (i * square_size);
-		const uint32_t y = border_width + square_padding;
-
-		bordered_rectangle(buffer->pixman_image, x, y,
-				square_size, square_size,
-				square_border_width, output->scale,
-				square_background_colour, square_border_colour);
-
-		if (TAG_ON(output->view_tags, i))
+	if ( buffer_count >= buffer_amount * surface_count )
+	{
+		stats.buffers_exhausted++;
+		if ( buffer_count >= BUFFER_MAX * surface_count )
 		{
-			bordered_rectangle(buffer->pixman_image,
-					x + square_inner_padding,
-					y + square_inner_padding,
-					square_size - 2 * square_inner_padding,
-					square_size - 2 * square_inner_padding,
-					square_border_width, output->scale,
-					square_occupied_colour, square_border_colour);
+			flight_record(&flight, FLIGHT_NEXT_BUFFER, name, FLIGHT_BUFFER_NONE, 0);
+			return NULL;
 		}
+		stats.buffer_ring_grown++;
 	}
-	#undef TAG_ON
+	buffer = create_buffer(scale);
+	flight_record(&flight, FLIGHT_NEXT_BUFFER, name,
+			buffer == NULL ? FLIGHT_BUFFER_NONE : FLIGHT_BUFFER_CREATED,
+			buffer == NULL ? 0 : buffer->id);
+	return buffer;
+}
 
-	wl_surface_set_buffer_scale(surface->wl_surface, (int32_t)output->scale);
-	wl_surface_attach(surface->wl_surface, buffer->wl_buffer, 0, 0);
-	wl_surface_damage_buffer(surface->wl_surface, 0, 0,
-			(int32_t)buffer->width, (int32_t)buffer->height);
-	buffer->busy = true;
+/*************
+ *           *
+ *  Workers  *
+ *           *
+ *************/
+static void draw_job (struct Job *job)
+{
+	/* prepare_frame() created everything the frame needs, so drawing
+	 * can not fail.
+	 */
+	draw_frame(job->buffer->pixman_image, job->scale, &job->tags, job->partial ? &job->drawn : NULL);
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &output->surface->last_frame);
+/* Returns the next job of the batch, or NULL if all are taken. job_mutex
+ * must be held.
+ */
+static struct Job *take_job (void)
+{
+	if ( jobs_taken == jobs_open )
+		return NULL;
+	return &jobs[jobs_taken++];
 }
 
-static void layer_surface_handle_configure (void *data, struct zwlr_layer_surface_v1 *layer_surface,
-		uint32_t serial, uint32_t width, uint32_t height)
+static void *worker_run (void *data)
+{
+	pthread_mutex_lock(&job_mutex);
+	while (! workers_quit)
+	{
+		struct Job *job = take_job();
+		if ( job == NULL )
+		{
+			pthread_cond_wait(&jobs_posted, &job_mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&job_mutex);
+		draw_job(job);
+		pthread_mutex_lock(&job_mutex);
+		if ( ++jobs_done == jobs_open )
+			pthread_cond_signal(&jobs_finished);
+	}
+	pthread_mutex_unlock(&job_mutex);
+	return NULL;
+}
+
+/* Queues a frame to be drawn by run_jobs(). */
+static bool queue_job (struct Buffer *buffer, uint32_t scale, struct Tags *tags, struct Tags *drawn)
+{
+	if ( job_amount == job_capacity )
+	{
+		const size_t capacity = job_capacity == 0 ? 4 : 2 * job_capacity;
+		struct Job *tmp = realloc(jobs, capacity * sizeof(struct Job));
+		if ( tmp == NULL )
+		{
+			fprintf(stderr, "ERROR: realloc: %s.\n", strerror(errno));
+			return false;
+		}
+		jobs = tmp;
+		job_capacity = capacity;
+	}
+
+	struct Job *job = &jobs[job_amount++];
+	job->buffer = buffer;
+	job->scale = scale;
+	job->tags = *tags;
+	job->partial = drawn != NULL;
+	if ( drawn != NULL )
+		job->drawn = *drawn;
+	return true;
+}
+
+/* Draws all queued frames, the main thread taking jobs like the workers. */
+static void run_jobs (void)
+{
+	if ( job_amount == 0 )
+		return;
+
+	flight_record(&flight, FLIGHT_JOBS_BEGIN, 0, (uint32_t)job_amount, 0);
+	pthread_mutex_lock(&job_mutex);
+	jobs_open = job_amount;
+	jobs_taken = 0;
+	jobs_done = 0;
+	pthread_cond_broadcast(&jobs_posted);
+
+	struct Job *job;
+	while ( (job = take_job()) != NULL )
+	{
+		pthread_mutex_unlock(&job_mutex);
+		draw_job(job);
+		pthread_mutex_lock(&job_mutex);
+		jobs_done++;
+	}
+	while ( jobs_done < jobs_open )
+		pthread_cond_wait(&jobs_finished, &job_mutex);
+
+	jobs_open = 0;
+	jobs_taken = 0;
+	pthread_mutex_unlock(&job_mutex);
+	job_amount = 0;
+	flight_record(&flight, FLIGHT_JOBS_END, 0, 0, 0);
+}
+
+/* Starts the workers; with render_threads 0, one thread per available
+ * core is used. The workers inherit the signal mask, so this must be
+ * called after the signals are blocked.
+ */
+static void start_workers (void)
+{
+	if ( render_threads == 0 )
+	{
+		cpu_set_t set;
+		render_threads = sched_getaffinity(0, sizeof(set), &set) == 0
+			? (uint32_t)CPU_COUNT(&set) : 1;
+	}
+	if ( render_threads <= 1 )
+		return;
+
+	workers = calloc(render_threads - 1, sizeof(pthread_t));
+	if ( workers == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
+		return;
+	}
+
+	/* With fewer workers than asked for, frames are still drawn. */
+	for (; worker_amount < render_threads - 1; worker_amount++)
+	{
+		const int error = pthread_create(&workers[worker_amount], NULL, worker_run, NULL);
+		if ( error != 0 )
+		{
+			fprintf(stderr, "ERROR: pthread_create: %s.\n", strerror(error));
+			break;
+		}
+	}
+}
+
+static void stop_workers (void)
+{
+	pthread_mutex_lock(&job_mutex);
+	workers_quit = true;
+	pthread_cond_broadcast(&jobs_posted);
+	pthread_mutex_unlock(&job_mutex);
+
+	for (uint32_t i = 0; i < worker_amount; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	free(jobs);
+}
+
+/***********
+ *         *
+ *  Timer  *
+ *         *
+ ***********/
+
+static uint64_t now_nsec (void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+static void heap_set (size_t index, struct Output *output)
+{
+	hide_heap[index] = output;
+	output->hide_index = index;
+}
+
+static void heap_sift_up (size_t index)
+{
+	struct Output *output = hide_heap[index];
+	while ( index > 0 )
+	{
+		const size_t parent = (index - 1) / 2;
+		if ( hide_heap[parent]->hide_deadline <= output->hide_deadline )
+			break;
+		heap_set(index, hide_heap[parent]);
+		index = parent;
+	}
+	heap_set(index, output);
+}
+
+static void heap_sift_down (size_t index)
+{
+	struct Output *output = hide_heap[index];
+	for (;;)
+	{
+		size_t child = 2 * index + 1;
+		if ( child >= hide_heap_length )
+			break;
+		if ( child + 1 < hide_heap_length
+				&& hide_heap[child + 1]->hide_deadline < hide_heap[child]->hide_deadline )
+			child++;
+		if ( output->hide_deadline <= hide_heap[child]->hide_deadline )
+			break;
+		heap_set(index, hide_heap[child]);
+		index = child;
+	}
+	heap_set(index, output);
+}
+
+/* Arms the timer for the earliest deadline, unless it already fires before
+ * that. Deadlines only ever move later, so a timer that fires early is
+ * simply re-armed then, which saves a syscall every time a pop-up is kept
+ * up for longer.
+ */
+static void arm_timer (void)
+{
+	if ( hide_heap_length == 0 )
+		return;
+
+	const uint64_t deadline = hide_heap[0]->hide_deadline;
+	if ( timer_deadline != 0 && timer_deadline <= deadline )
+		return;
+
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec  = (time_t)(deadline / NSEC_PER_SEC),
+			.tv_nsec = (long)(deadline % NSEC_PER_SEC),
+		},
+	};
+	if ( timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1 )
+	{
+		fprintf(stderr, "ERROR: timerfd_settime: %s.\n", strerror(errno));
+		return;
+	}
+	timer_deadline = deadline;
+}
+
+/* (Re-)schedules hiding the pop-up of the output HIDE_DELAY_NSEC from now. */
+static void schedule_hide (struct Output *output)
+{
+	output->hide_deadline = now_nsec() + HIDE_DELAY_NSEC;
+
+	if ( output->hide_index != HIDE_NONE )
+	{
+		/* The deadline can only have moved later. */
+		heap_sift_down(output->hide_index);
+		return;
+	}
+
+	if ( hide_heap_length == hide_heap_capacity )
+	{
+		const size_t capacity = hide_heap_capacity == 0 ? 4 : 2 * hide_heap_capacity;
+		struct Output **heap = realloc(hide_heap, capacity * sizeof(struct Output *));
+		if ( heap == NULL )
+		{
+			fprintf(stderr, "ERROR: realloc: %s.\n", strerror(errno));
+			return;
+		}
+		hide_heap = heap;
+		hide_heap_capacity = capacity;
+	}
+
+	hide_heap[hide_heap_length] = output;
+	heap_sift_up(hide_heap_length++);
+	arm_timer();
+}
+
+static void cancel_hide (struct Output *output)
+{
+	const size_t index = output->hide_index;
+	if ( index == HIDE_NONE )
+		return;
+	output->hide_index = HIDE_NONE;
+
+	if ( index == --hide_heap_length )
+		return;
+
+	heap_set(index, hide_heap[hide_heap_length]);
+	heap_sift_up(index);
+	heap_sift_down(hide_heap[index]->hide_index);
+}
+
+/***********
+ *         *
+ *  Trace  *
+ *         *
+ ***********/
+static void stop_recording (void)
+{
+	if ( fclose(record_file) == EOF )
+		fprintf(stderr, "ERROR: fclose: %s.\n", strerror(errno));
+	record_file = NULL;
+}
+
+static bool start_recording (const char *path)
+{
+	record_file = fopen(path, "w");
+	if ( record_file == NULL )
+	{
+		fprintf(stderr, "ERROR: fopen: %s: %s.\n", path, strerror(errno));
+		return false;
+	}
+
+	struct Trace_header header = {
+		.version = TRACE_VERSION,
+	};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	if ( fwrite(&header, sizeof(header), 1, record_file) != 1 )
+	{
+		fprintf(stderr, "ERROR: fwrite: %s: %s.\n", path, strerror(errno));
+		stop_recording();
+		return false;
+	}
+
+	record_start = now_nsec();
+	return true;
+}
+
+/* Appends an event to the trace, if recording. Writes are buffered; a
+ * failing write stops the recording.
+ */
+static void record_event (enum Trace_type type, uint32_t output, const void *payload, size_t length)
+{
+	if ( record_file == NULL )
+		return;
+
+	/* Payloads are uint32_t values, so a long one is cut to whole values. */
+	if ( length > UINT16_MAX )
+		length = UINT16_MAX & ~3u;
+
+	struct Trace_record record = {
+		.time   = now_nsec() - record_start,
+		.output = output,
+		.type   = (uint16_t)type,
+		.length = (uint16_t)length,
+	};
+	if ( fwrite(&record, sizeof(record), 1, record_file) != 1
+			|| (length > 0 && fwrite(payload, length, 1, record_file) != 1) )
+	{
+		fprintf(stderr, "ERROR: fwrite: %s. Recording stopped.\n", strerror(errno));
+		stop_recording();
+	}
+}
+
+/***********
+ *         *
+ *  Scene  *
+ *         *
+ ***********/
+static bool colours_opaque (void)
+{
+	for (size_t i = 0; i < SCENE_COLOUR_AMOUNT; i++)
+		if ( scene_colours[i]->alpha != 0xffff )
+			return false;
+	return true;
+}
+
+/* Returns why the subsurface backend can not be used, or NULL if it can.
+ * Parts overlap, so translucent colours would blend with the parts below
+ * instead of replacing them like the shm backend does.
+ */
+static const char *scene_unsupported (void)
+{
+	if ( wl_subcompositor == NULL )
+		return "the compositor does not support wl_subcompositor";
+	if ( viewporter == NULL )
+		return "the compositor does not support wp_viewporter";
+	if ( fade_duration > 0 )
+		return "it can not fade out";
+	if ( tag_label_amount > 0 )
+		return "it can not draw tag labels";
+	if (! colours_opaque())
+		return "it can not draw translucent colours";
+	return NULL;
+}
+
+static bool init_colour_buffers (void)
+{
+	if ( single_pixel_buffer_manager != NULL )
+	{
+		/* Single pixel buffers take 32 bit channels. */
+		for (size_t i = 0; i < SCENE_COLOUR_AMOUNT; i++)
+			colour_buffers[i] = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+					single_pixel_buffer_manager,
+					(uint32_t)scene_colours[i]->red * 0x10001,
+					(uint32_t)scene_colours[i]->green * 0x10001,
+					(uint32_t)scene_colours[i]->blue * 0x10001,
+					(uint32_t)scene_colours[i]->alpha * 0x10001);
+		stats.buffers_created += SCENE_COLOUR_AMOUNT;
+		return true;
+	}
+
+	if (! init_pool(&colour_pool, SCENE_COLOUR_AMOUNT * sizeof(uint32_t)))
+		return false;
+
+	uint32_t *pixels = (uint32_t *)colour_pool.mmap;
+	for (size_t i = 0; i < SCENE_COLOUR_AMOUNT; i++)
+	{
+		pixels[i] = colour_to_pixel(scene_colours[i]);
+		colour_buffers[i] = wl_shm_pool_create_buffer(colour_pool.wl_shm_pool,
+				(int32_t)(i * sizeof(uint32_t)), 1, 1, sizeof(uint32_t),
+				WL_SHM_FORMAT_ARGB8888);
+	}
+	stats.buffers_created += SCENE_COLOUR_AMOUNT;
+	return true;
+}
+
+static void finish_colour_buffers (void)
+{
+	for (size_t i = 0; i < SCENE_COLOUR_AMOUNT; i++)
+		if ( colour_buffers[i] != NULL )
+			wl_buffer_destroy(colour_buffers[i]);
+	finish_pool(&colour_pool);
+}
+
+static struct wl_buffer *colour_buffer (pixman_color_t *colour)
+{
+	for (size_t i = 0; i < SCENE_COLOUR_AMOUNT; i++)
+		if ( scene_colours[i] == colour )
+			return colour_buffers[i];
+	return NULL;
+}
+
+/* Positions and sizes are in surface coordinates, so the parts do not
+ * depend on the scale at all.
+ */
+static void init_part (struct Part *part, struct wl_surface *parent, struct wl_region *region,
+		int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	/* Viewports can not be empty; such parts are never shown. */
+	if ( width <= 0 || height <= 0 )
+		return;
+
+	part->wl_surface = wl_compositor_create_surface(wl_compositor);
+	part->subsurface = wl_subcompositor_get_subsurface(wl_subcompositor,
+			part->wl_surface, parent);
+	wl_subsurface_set_position(part->subsurface, x, y);
+	part->viewport = wp_viewporter_get_viewport(viewporter, part->wl_surface);
+	wp_viewport_set_destination(part->viewport, width, height);
+	wl_surface_set_input_region(part->wl_surface, region);
+}
+
+static void finish_part (struct Part *part)
+{
+	if ( part->wl_surface == NULL )
+		return;
+	wp_viewport_destroy(part->viewport);
+	wl_subsurface_destroy(part->subsurface);
+	wl_surface_destroy(part->wl_surface);
+}
+
+/* Attaches the buffer to the part, if it does not show it already. The
+ * subsurfaces are synchronized, so the change is applied with the next
+ * commit of the pop-up surface.
+ */
+static void set_part (struct Part *part, struct wl_buffer *buffer)
+{
+	if ( part->wl_surface == NULL || part->buffer == buffer )
+		return;
+	wl_surface_attach(part->wl_surface, buffer, 0, 0);
+	if ( buffer != NULL )
+		wl_surface_damage_buffer(part->wl_surface, 0, 0, 1, 1);
+	wl_surface_commit(part->wl_surface);
+	part->buffer = buffer;
+}
+
+/* Creates the parts of the pop-up, mirroring the rectangles the shm
+ * backend draws. New subsurfaces are stacked on top, so they are created
+ * bottom to top.
+ */
+static bool create_scene (struct Surface *surface)
+{
+	surface->parts = calloc(1 + PART_AMOUNT * tag_amount, sizeof(struct Part));
+	if ( surface->parts == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
+		return false;
+	}
+
+	struct wl_region *region = wl_compositor_create_region(wl_compositor);
+
+	const int32_t border = (int32_t)border_width;
+	init_part(&surface->parts[0], surface->wl_surface, region, border, border,
+			(int32_t)surface_width - 2 * border, (int32_t)surface_height - 2 * border);
+
+	const int32_t size = (int32_t)square_size;
+	const int32_t square_border = (int32_t)square_border_width;
+	const int32_t inner_padding = (int32_t)square_inner_padding;
+	for (uint32_t i = 0; i < tag_amount; i++)
+	{
+		struct Part *square = &surface->parts[1 + PART_AMOUNT * i];
+		const int32_t x = (int32_t)(border_width + (i + 1) * square_padding + i * square_size);
+		const int32_t y = (int32_t)(border_width + square_padding);
+
+		init_part(&square[PART_BORDER], surface->wl_surface, region,
+				x, y, size, size);
+		init_part(&square[PART_BACKGROUND], surface->wl_surface, region,
+				x + square_border, y + square_border,
+				size - 2 * square_border, size - 2 * square_border);
+		init_part(&square[PART_OCCUPIED_BORDER], surface->wl_surface, region,
+				x + inner_padding, y + inner_padding,
+				size - 2 * inner_padding, size - 2 * inner_padding);
+		init_part(&square[PART_OCCUPIED], surface->wl_surface, region,
+				x + inner_padding + square_border, y + inner_padding + square_border,
+				size - 2 * (inner_padding + square_border),
+				size - 2 * (inner_padding + square_border));
+	}
+
+	wl_region_destroy(region);
+	return true;
+}
+
+static void destroy_scene (struct Surface *surface)
+{
+	for (uint32_t i = 0; i < 1 + PART_AMOUNT * tag_amount; i++)
+		finish_part(&surface->parts[i]);
+	free(surface->parts);
+	surface->parts = NULL;
+}
+
+/* The subsurface backend counterpart of render_frame(). Only parts whose
+ * colour changed are touched; no pixels are written.
+ */
+static bool render_scene (struct Output *output)
+{
+	struct Surface *surface = output->surface;
+
+	set_part(&surface->parts[0], colour_buffer(&background_colour));
+	for (uint32_t i = 0; i < tag_amount; i++)
+	{
+		const uint32_t sprite = tag_sprite(&output->tags, i);
+		const bool occupied = sprite >= SQUARE_STATE_AMOUNT;
+		pixman_color_t *background, *border, *occupied_colour;
+		square_colours((enum Square_state)(sprite % SQUARE_STATE_AMOUNT),
+				&background, &border, &occupied_colour);
+
+		struct Part *square = &surface->parts[1 + PART_AMOUNT * i];
+		set_part(&square[PART_BORDER], colour_buffer(border));
+		set_part(&square[PART_BACKGROUND], colour_buffer(background));
+		set_part(&square[PART_OCCUPIED_BORDER], occupied ? colour_buffer(border) : NULL);
+		set_part(&square[PART_OCCUPIED], occupied ? colour_buffer(occupied_colour) : NULL);
+	}
+
+	/* The surface itself only needs a buffer after it was hidden. */
+	if ( surface->width == 0 )
+	{
+		wl_surface_attach(surface->wl_surface, colour_buffer(&border_colour), 0, 0);
+		wl_surface_damage_buffer(surface->wl_surface, 0, 0, 1, 1);
+		surface->width = surface_width;
+		surface->height = surface_height;
+	}
+	surface->tags = output->tags;
+
+	stats.renders++;
+	schedule_hide(output);
+	return true;
+}
+
+/*************
+ *           *
+ *  Surface  *
+ *           *
+ *************/
+/* Returns the scale to render at, in 120ths. Without a viewport the buffer
+ * scale of the surface is used, which must be an integer.
+ */
+static uint32_t render_scale (struct Output *output)
+{
+	if ( output->fractional_scale != 0 )
+		return output->fractional_scale;
+	return output->scale * 120;
+}
+
+/* Marks the whole surface as opaque, or nothing. The region is cleared
+ * while fading with the alpha modifier.
+ */
+static void set_opaque (struct Surface *surface, bool opaque)
+{
+	struct wl_region *region = NULL;
+	if (opaque)
+	{
+		region = wl_compositor_create_region(wl_compositor);
+		wl_region_add(region, 0, 0, (int32_t)surface_width, (int32_t)surface_height);
+	}
+	wl_surface_set_opaque_region(surface->wl_surface, region);
+	if ( region != NULL )
+		wl_region_destroy(region);
+	surface->opaque = opaque;
+}
+
+/* Renders and attaches a frame. Returns false if there was nothing to
+ * attach.
+ */
+static bool render_frame (struct Output *output)
+{
+	struct Surface *surface = output->surface;
+
+	if (! surface->configured)
+		return false;
+
+	if ( surface->parts != NULL )
+		return render_scene(output);
+
+	const uint32_t scale = render_scale(output);
+
+	/* Another pop-up may already show these tags at this scale. */
+	struct Buffer *buffer = cached_buffer(&output->tags, scale);
+	if ( buffer != NULL )
+	{
+		stats.renders_shared++;
+		flight_record(&flight, FLIGHT_NEXT_BUFFER, output->global_name,
+				FLIGHT_BUFFER_SHARED, buffer->id);
+	}
+	else
+	{
+		buffer = next_buffer(surface, scale);
+		if ( buffer == NULL )
+		{
+			/* The compositor holds all buffers. The frame is
+			 * rendered once it releases one, instead of leaving
+			 * stale tags on screen.
+			 */
+			stats.frames_dropped++;
+			surface->render_pending = true;
+			return false;
+		}
+
+		if (! prepare_frame(buffer->width, buffer->height, scale) )
+		{
+			buffer->drawn = false;
+			return false;
+		}
+
+		/* While batching, the frame is drawn before the commit. */
+		struct Tags *drawn = buffer->drawn ? &buffer->tags : NULL;
+		if (! batching || ! queue_job(buffer, scale, &output->tags, drawn) )
+			draw_frame(buffer->pixman_image, scale, &output->tags, drawn);
+		buffer->tags = output->tags;
+		buffer->drawn = true;
+		stats.renders++;
+	}
+
+	if ( buffer_format->opaque && ! surface->opaque )
+		set_opaque(surface, true);
+
+	/* A fade-out was interrupted. The alpha modifier is reset, otherwise
+	 * the faded frame on screen is replaced as a whole.
+	 */
+	const bool faded = surface->alpha != 255;
+	if ( faded && surface->alpha_modifier != NULL )
+		wp_alpha_modifier_surface_v1_set_multiplier(surface->alpha_modifier, UINT32_MAX);
+	surface->alpha = 255;
+
+	/* If the previously attached buffer had a different size, or there
+	 * was none, everything is damaged.
+	 */
+	const bool damage_all = surface->width != buffer->width
+		|| surface->height != buffer->height
+		|| ( faded && surface->alpha_modifier == NULL );
+	if (damage_all)
+		wl_surface_damage_buffer(surface->wl_surface, 0, 0,
+				(int32_t)buffer->width, (int32_t)buffer->height);
+
+	/* Otherwise only squares that differ from what the last attached
+	 * buffer showed are damaged.
+	 */
+	const uint32_t size = scale_length(square_size, scale);
+	for (uint32_t i = 0; ! damage_all && i < tag_amount; i++)
+	{
+		if ( tag_sprite(&output->tags, i) == tag_sprite(&surface->tags, i) )
+			continue;
+
+		uint32_t x, y;
+		square_position(i, scale, &x, &y);
+		wl_surface_damage_buffer(surface->wl_surface,
+				(int32_t)x, (int32_t)y,
+				(int32_t)size, (int32_t)size);
+	}
+
+	/* With a viewport the surface size is set through its destination and
+	 * the buffer scale stays 1.
+	 */
+	if ( surface->viewport == NULL )
+		wl_surface_set_buffer_scale(surface->wl_surface, (int32_t)(scale / 120));
+	wl_surface_attach(surface->wl_surface, buffer->wl_buffer, 0, 0);
+	buffer->busy = true;
+
+	set_current_buffer(surface, buffer);
+	surface->width = buffer->width;
+	surface->height = buffer->height;
+	surface->tags = output->tags;
+
+	schedule_hide(output);
+	return true;
+}
+
+/* Shows the last rendered frame with the given opacity. Nothing is
+ * rasterised; without an alpha modifier the frame from before the fade is
+ * composited into an idle buffer with the opacity as mask alpha. Every
+ * faded frame is drawn from that frame rather than from the previous
+ * faded one, so rounding errors do not add up over the fade.
+ */
+static void render_fade_frame (struct Output *output, uint32_t alpha)
+{
+	struct Surface *surface = output->surface;
+
+	if ( surface->alpha_modifier != NULL )
+	{
+		if ( surface->opaque )
+			set_opaque(surface, false);
+		wp_alpha_modifier_surface_v1_set_multiplier(surface->alpha_modifier,
+				alpha * (UINT32_MAX / 255));
+		surface->alpha = alpha;
+		return;
+	}
+
+	if ( surface->fade_source == NULL )
+		set_fade_source(surface, surface->current);
+	struct Buffer *source = surface->fade_source;
+	if ( source == NULL || surface->alpha == alpha )
+		return;
+
+	struct Buffer *buffer = next_buffer(surface, source->scale);
+	if ( buffer == NULL )
+		return;
+
+	if ( fade_mask == NULL )
+	{
+		fade_mask = pixman_image_create_bits(PIXMAN_a8r8g8b8, 1, 1, &fade_mask_pixel, 4);
+		if ( fade_mask == NULL )
+			return;
+		pixman_image_set_repeat(fade_mask, PIXMAN_REPEAT_NORMAL);
+	}
+
+	fade_mask_pixel = alpha << 24;
+
+	pixman_image_composite32(PIXMAN_OP_SRC, source->pixman_image, fade_mask,
+			buffer->pixman_image, 0, 0, 0, 0, 0, 0,
+			(int32_t)buffer->width, (int32_t)buffer->height);
+	wl_surface_damage_buffer(surface->wl_surface, 0, 0,
+			(int32_t)buffer->width, (int32_t)buffer->height);
+	wl_surface_attach(surface->wl_surface, buffer->wl_buffer, 0, 0);
+
+	buffer->busy = true;
+	buffer->drawn = false;
+	set_current_buffer(surface, buffer);
+	surface->alpha = alpha;
+}
+
+static void frame_handle_done (void *data, struct wl_callback *wl_callback, uint32_t time);
+
+static const struct wl_callback_listener frame_callback_listener = {
+	.done = frame_handle_done,
+};
+
+static void hide_surface (struct Surface *surface);
+
+static uint64_t cpu_time_nsec (void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+/* Renders the next fade-out frame, or hides the pop-up once the fade is
+ * over.
+ */
+static void continue_fade (struct Output *output)
+{
+	struct Surface *surface = output->surface;
+
+	const uint64_t elapsed = now_nsec() - surface->fade_start;
+	if ( elapsed >= fade_duration )
+	{
+		hide_surface(surface);
+		return;
+	}
+
+	const uint64_t cpu_start = cpu_time_nsec();
+
+	render_fade_frame(output, (uint32_t)(255 - 255 * elapsed / fade_duration));
+	surface->frame_callback = wl_surface_frame(surface->wl_surface);
+	wl_callback_add_listener(surface->frame_callback, &frame_callback_listener, output);
+	wl_surface_commit(surface->wl_surface);
+	flight_record(&flight, FLIGHT_COMMIT, output->global_name, 0, 0);
+
+	stats.commits++;
+	stats.fade_cpu_nsec += cpu_time_nsec() - cpu_start;
+	stats.fade_frames++;
+}
+
+static void start_fade (struct Output *output)
+{
+	struct Surface *surface = output->surface;
+	surface->fading = true;
+	surface->fade_start = now_nsec();
+
+	/* Otherwise the fade continues with the pending frame callback. */
+	if ( surface->frame_callback == NULL )
+		continue_fade(output);
+}
+
+static void frame_handle_done (void *data, struct wl_callback *wl_callback, uint32_t time)
+{
+	struct Output *output = (struct Output *)data;
+	struct Surface *surface = output->surface;
+
+	wl_callback_destroy(wl_callback);
+	surface->frame_callback = NULL;
+
+	if (surface->fading)
+	{
+		continue_fade(output);
+		return;
+	}
+
+	if (! surface->dirty)
+		return;
+	surface->dirty = false;
+	commit_frame(output);
+}
+
+static void finish_commit (struct Output *output)
+{
+	wl_surface_commit(output->surface->wl_surface);
+	flight_record(&flight, FLIGHT_COMMIT, output->global_name, 0, 0);
+	stats.commits++;
+
+	if ( output->update_time != 0 )
+	{
+		histogram_record(&stats.latency, now_nsec() - output->update_time);
+		output->update_time = 0;
+	}
+}
+
+static void commit_frame (struct Output *output)
+{
+	struct Surface *surface = output->surface;
+	flight_record(&flight, FLIGHT_RENDER_BEGIN, output->global_name, 0, 0);
+	const bool rendered = render_frame(output);
+	flight_record(&flight, FLIGHT_RENDER_END, output->global_name, rendered, 0);
+	if (! rendered)
+		return;
+	surface->frame_callback = wl_surface_frame(surface->wl_surface);
+	wl_callback_add_listener(surface->frame_callback, &frame_callback_listener, output);
+
+	/* The compositor reads the buffer once it is committed, so while
+	 * batching that waits until the workers are done.
+	 */
+	if ( batching )
+		output->commit_pending = true;
+	else
+		finish_commit(output);
+}
+
+static void layer_surface_handle_configure (void *data, struct zwlr_layer_surface_v1 *layer_surface,
+		uint32_t serial, uint32_t width, uint32_t height)
 {
 	struct Output *output = (struct Output *)data;
 	struct Surface *surface = output->surface;
 	surface->configured = true;
+	flight_record(&flight, FLIGHT_CONFIGURE, output->global_name, width, height);
 	zwlr_layer_surface_v1_ack_configure(surface->layer_surface, serial);
-	render_frame(output);
-	wl_surface_commit(surface->wl_surface);
+
+	/* Hidden surfaces are re-armed right away, so a configure event does
+	 * not mean there is something to show. The ack is applied with the
+	 * commit of the next pop-up.
+	 */
+	if (! surface->visible)
+		return;
+
+	if ( surface->frame_callback != NULL )
+		surface->dirty = true;
+	else
+		commit_frame(output);
 }
 
 static void destroy_surface (struct Surface *surface)
 {
+	flight_record(&flight, FLIGHT_SURFACE_DESTROY, surface->output->global_name, 0, 0);
+	if ( surface->frame_callback != NULL )
+		wl_callback_destroy(surface->frame_callback);
+	if ( surface->alpha_modifier != NULL )
+		wp_alpha_modifier_surface_v1_destroy(surface->alpha_modifier);
+	if ( surface->fractional_scale != NULL )
+		wp_fractional_scale_v1_destroy(surface->fractional_scale);
+	if ( surface->viewport != NULL )
+		wp_viewport_destroy(surface->viewport);
+	if ( surface->parts != NULL )
+		destroy_scene(surface);
 	if ( surface->layer_surface != NULL )
 		zwlr_layer_surface_v1_destroy(surface->layer_surface);
 	if ( surface->wl_surface != NULL )
 		wl_surface_destroy(surface->wl_surface );
 
-	finish_buffer(&surface->buffer[0]);
-	finish_buffer(&surface->buffer[1]);
-
+	set_current_buffer(surface, NULL);
+	set_fade_source(surface, NULL);
 	free(surface);
+	surface_count--;
+	trim_buffers(buffer_amount * surface_count);
+	stats.surfaces_destroyed++;
 }
 
 static void layer_surface_handle_closed (void *data, struct zwlr_layer_surface_v1 *layer_surface)
 {
 	struct Output *output = (struct Output *)data;
+	cancel_hide(output);
 	destroy_surface(output->surface);
 	output->surface = NULL;
 }
@@ -471,21 +1739,112 @@ const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 	.closed    = layer_surface_handle_closed
 };
 
-static void update_surface (struct Output *output)
+/* Sets the layer surface state and does a buffer-less commit, which makes
+ * the compositor send a configure event.
+ */
+static void arm_surface (struct Surface *surface)
 {
-	if ( output->surface != NULL )
+	zwlr_layer_surface_v1_set_size(surface->layer_surface,
+			surface_width, surface_height);
+	zwlr_layer_surface_v1_set_anchor(surface->layer_surface,
+			surface_anchors);
+	zwlr_layer_surface_v1_set_margin(surface->layer_surface,
+			(int32_t)margin_top, (int32_t)margin_right,
+			(int32_t)margin_bottom, (int32_t)margin_left);
+	wl_surface_commit(surface->wl_surface);
+	flight_record(&flight, FLIGHT_COMMIT, surface->output->global_name, 0, 0);
+	stats.commits++;
+}
+
+/* Unmaps the surface but keeps it and its buffers around. Unmapping returns
+ * the layer surface to its initial state, so it is re-armed immediately;
+ * by the time the next pop-up is needed the configure event has long been
+ * handled and showing the surface is a single render and commit.
+ */
+static void hide_surface (struct Surface *surface)
+{
+	/* Unmapped surfaces do not get frame callbacks. */
+	if ( surface->frame_callback != NULL )
 	{
-		render_frame(output);
-		wl_surface_commit(output->surface->wl_surface);
-		return;
+		wl_callback_destroy(surface->frame_callback);
+		surface->frame_callback = NULL;
+	}
+	surface->dirty = false;
+	surface->render_pending = false;
+	surface->fading = false;
+
+	/* The multiplier is double-buffered, so it is back to opaque by the
+	 * time the surface is mapped again.
+	 */
+	if ( surface->alpha != 255 && surface->alpha_modifier != NULL )
+		wp_alpha_modifier_surface_v1_set_multiplier(surface->alpha_modifier, UINT32_MAX);
+	surface->alpha = 255;
+	set_current_buffer(surface, NULL);
+	set_fade_source(surface, NULL);
+	surface->output->update_time = 0;
+
+	wl_surface_attach(surface->wl_surface, NULL, 0, 0);
+	wl_surface_commit(surface->wl_surface);
+	flight_record(&flight, FLIGHT_COMMIT, surface->output->global_name, 0, 0);
+	stats.commits++;
+	surface->width = 0;
+	surface->height = 0;
+	surface->configured = false;
+	surface->visible = false;
+	arm_surface(surface);
+}
+
+/* Hides the pop-ups whose deadline has passed; only those outputs are
+ * touched.
+ */
+static void handle_hide_timer (void)
+{
+	uint64_t expirations;
+	if ( read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN )
+		fprintf(stderr, "ERROR: read: %s.\n", strerror(errno));
+	timer_deadline = 0;
+
+	const uint64_t now = now_nsec();
+	while ( hide_heap_length > 0 && hide_heap[0]->hide_deadline <= now )
+	{
+		struct Output *output = hide_heap[0];
+		cancel_hide(output);
+		if ( fade_duration == 0 )
+			hide_surface(output->surface);
+		else
+			start_fade(output);
 	}
 
+	arm_timer();
+}
+
+static void fractional_scale_handle_preferred_scale (void *data,
+		struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale)
+{
+	struct Output *output = (struct Output *)data;
+	if ( output->fractional_scale == scale )
+		return;
+	output->fractional_scale = scale;
+	if ( output->surface->visible )
+		output->update_pending = true;
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_handle_preferred_scale,
+};
+
+static bool create_surface (struct Output *output)
+{
 	output->surface = calloc(1, sizeof(struct Surface));
 	if ( output->surface == NULL )
 	{
 		fprintf(stderr, "ERROR: calloc: %s.\n", strerror(errno));
-		return;
+		return false;
 	}
+	stats.surfaces_created++;
+	surface_count++;
+	output->surface->output = output;
+	output->surface->alpha = 255;
 
 	output->surface->wl_surface = wl_compositor_create_surface(wl_compositor);
 	output->surface->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
@@ -494,19 +1853,95 @@ static void update_surface (struct Output *output)
 			"river-tag-overlay");
 	zwlr_layer_surface_v1_add_listener(output->surface->layer_surface,
 			&layer_surface_listener, output);
-	zwlr_layer_surface_v1_set_size(output->surface->layer_surface,
-			surface_width, surface_height);
-	zwlr_layer_surface_v1_set_anchor(output->surface->layer_surface,
-			surface_anchors);
-	zwlr_layer_surface_v1_set_margin(output->surface->layer_surface,
-			(int32_t)margin_top, (int32_t)margin_right,
-			(int32_t)margin_bottom, (int32_t)margin_left);
+
+	/* Fractional scales need a viewport to set the surface size, which
+	 * then no longer follows from the buffer size.
+	 */
+	if ( viewporter != NULL )
+	{
+		output->surface->viewport = wp_viewporter_get_viewport(viewporter,
+				output->surface->wl_surface);
+		wp_viewport_set_destination(output->surface->viewport,
+				(int32_t)surface_width, (int32_t)surface_height);
+
+		if ( fractional_scale_manager != NULL )
+		{
+			output->surface->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+					fractional_scale_manager, output->surface->wl_surface);
+			wp_fractional_scale_v1_add_listener(output->surface->fractional_scale,
+					&fractional_scale_listener, output);
+		}
+	}
+
+	if ( backend == BACKEND_SUBSURFACE && ! create_scene(output->surface) )
+	{
+		destroy_surface(output->surface);
+		output->surface = NULL;
+		return false;
+	}
+
+	if ( fade_duration > 0 && alpha_modifier_manager != NULL )
+		output->surface->alpha_modifier = wp_alpha_modifier_v1_get_surface(
+				alpha_modifier_manager, output->surface->wl_surface);
 
 	struct wl_region *region = wl_compositor_create_region(wl_compositor);
 	wl_surface_set_input_region(output->surface->wl_surface, region);
 	wl_region_destroy(region);
 
-	wl_surface_commit(output->surface->wl_surface);
+	arm_surface(output->surface);
+
+	return true;
+}
+
+/* Whether the last attached buffer already shows the current state. */
+static bool surface_up_to_date (struct Output *output)
+{
+	struct Surface *surface = output->surface;
+	if ( surface->parts != NULL )
+		return surface->width != 0 && tags_equal(&surface->tags, &output->tags);
+
+	const uint32_t scale = render_scale(output);
+	return surface->alpha == 255
+		&& surface->width == scale_length(surface_width, scale)
+		&& surface->height == scale_length(surface_height, scale)
+		&& tags_equal(&surface->tags, &output->tags);
+}
+
+static void update_surface (struct Output *output)
+{
+	flight_record(&flight, FLIGHT_UPDATE_SURFACE, output->global_name, 0, 0);
+	if ( output->surface == NULL && ! create_surface(output) )
+		return;
+
+	output->surface->visible = true;
+	output->surface->fading = false;
+	set_fade_source(output->surface, NULL);
+
+	/* If the surface is still waiting for its configure event, the frame
+	 * will be rendered once it arrives.
+	 */
+	if (! output->surface->configured)
+		return;
+
+	/* Nothing to render or commit if the pop-up already shows this state,
+	 * but it stays up for another half second.
+	 */
+	if ( surface_up_to_date(output) )
+	{
+		output->surface->dirty = false;
+		output->update_time = 0;
+		schedule_hide(output);
+		return;
+	}
+
+	/* Render right away if the compositor is not still busy with the
+	 * previous frame, so the pop-up appears within one refresh of the
+	 * first event. Otherwise wait for the frame callback.
+	 */
+	if ( output->surface->frame_callback != NULL )
+		output->surface->dirty = true;
+	else
+		commit_frame(output);
 }
 
 /************
@@ -514,44 +1949,61 @@ static void update_surface (struct Output *output)
  *  Output  *
  *          *
  ************/
+/* Marks the pop-up of the output for an update once the dispatch is done. */
+static void request_update (struct Output *output)
+{
+	output->update_pending = true;
+	if ( output->update_time == 0 )
+		output->update_time = now_nsec();
+}
+
 static void river_output_status_handle_focused_tags (void *data, struct zriver_output_status_v1 *river_status,
 		uint32_t tags)
 {
 	struct Output *output = (struct Output *)data;
-	output->focused_tags = tags;
-	update_surface(output);
+	stats.focused_tags_events++;
+	record_event(TRACE_FOCUSED_TAGS, output->global_name, &tags, sizeof(tags));
+	flight_record(&flight, FLIGHT_FOCUSED_TAGS, output->global_name, tags, 0);
+	output->tags.focused = tags;
+	request_update(output);
 }
 
 static void river_output_status_handle_view_tags (void *data, struct zriver_output_status_v1 *river_status,
 		struct wl_array *tags)
 {
 	struct Output *output = (struct Output *)data;
+	stats.view_tags_events++;
+	record_event(TRACE_VIEW_TAGS, output->global_name, tags->data, tags->size);
 	uint32_t *i;
-	output->view_tags = 0;
+	output->tags.view = 0;
 	wl_array_for_each(i, tags)
-		output->view_tags |= *i;
+		output->tags.view |= *i;
+	flight_record(&flight, FLIGHT_VIEW_TAGS, output->global_name, output->tags.view, 0);
 
 	/* Only update the popup if it is already active. */
-	if ( output->surface != NULL )
-		update_surface(output);
+	if ( output->surface != NULL && output->surface->visible )
+		request_update(output);
 }
 
 static void river_output_status_handle_urgent_tags (void *data, struct zriver_output_status_v1 *river_status,
 		uint32_t tags)
 {
 	struct Output *output = (struct Output *)data;
-	const uint32_t old_urgent_tags = output->urgent_tags;
-	output->urgent_tags = tags;
+	stats.urgent_tags_events++;
+	record_event(TRACE_URGENT_TAGS, output->global_name, &tags, sizeof(tags));
+	flight_record(&flight, FLIGHT_URGENT_TAGS, output->global_name, tags, 0);
+	const uint32_t old_urgent_tags = output->tags.urgent;
+	output->tags.urgent = tags;
 
 	/* Only display pop-up if the urgent tags are not focused already. */
-	if ( output->urgent_tags != output->focused_tags )
+	if ( output->tags.urgent != output->tags.focused )
 	{
 		/* Only display pop-up if there are new urgent tags, not if an
 		 * old one just expired.
 		 */
-		const uint32_t diff = old_urgent_tags ^ output->urgent_tags;
-		if ( (diff & output->urgent_tags) > 0 )
-			update_surface(output);
+		const uint32_t diff = old_urgent_tags ^ output->tags.urgent;
+		if ( (diff & output->tags.urgent) > 0 )
+			request_update(output);
 	}
 }
 
@@ -561,8 +2013,63 @@ static const struct zriver_output_status_v1_listener river_output_status_listene
 	.urgent_tags  = river_output_status_handle_urgent_tags,
 };
 
+/* Updates the pop-ups of all outputs that received status events. Called
+ * after every dispatch, so a burst of events, like the focused_tags and
+ * view_tags events sent for a single tag switch, results in one update.
+ */
+static void update_outputs (void)
+{
+	/* With workers, the frames of all updated pop-ups are drawn in
+	 * parallel once all are rendered, and committed after that.
+	 */
+	batching = worker_amount > 0;
+
+	struct Output *output;
+	wl_list_for_each(output, &outputs, link)
+	{
+		if (! output->update_pending)
+			continue;
+		output->update_pending = false;
+		update_surface(output);
+	}
+
+	if (! batching)
+		return;
+	batching = false;
+
+	run_jobs();
+	wl_list_for_each(output, &outputs, link)
+	{
+		if (! output->commit_pending)
+			continue;
+		output->commit_pending = false;
+		finish_commit(output);
+	}
+}
+
+static void noop ( ) { }
+
+static void output_handle_scale (void *data, struct wl_output *wl_output, int32_t factor)
+{
+	struct Output *output = (struct Output *)data;
+	record_event(TRACE_OUTPUT_SCALE, output->global_name, &factor, sizeof(factor));
+	output->scale = (uint32_t)factor;
+
+	/* A visible pop-up is re-rendered at the new scale. */
+	if ( output->surface != NULL && output->surface->visible )
+		request_update(output);
+}
+
+static const struct wl_output_listener output_listener = {
+	.geometry = noop,
+	.mode     = noop,
+	.done     = noop,
+	.scale    = output_handle_scale,
+};
+
 static void destroy_output (struct Output *output)
 {
+	cancel_hide(output);
 	if ( output->surface != NULL )
 		destroy_surface(output->surface);
 	if ( output->river_status != NULL )
@@ -595,22 +2102,47 @@ static void configure_output (struct Output *output)
  *  Seat  *
  *        *
  **********/
+static struct Output *output_from_wl_output (struct wl_output *wl_output)
+{
+	struct Output *output;
+	wl_list_for_each(output, &outputs, link)
+		if ( output->wl_output == wl_output )
+			return output;
+	return NULL;
+}
+
 static void river_seat_status_handle_focused_output (void *data, struct zriver_seat_status_v1 *seat_status,
 		struct wl_output *wl_output)
 {
 	/* Show surface on newly focused output. */
 	// TODO multi-seat?
-	struct Output *output;
-	wl_list_for_each(output, &outputs, link)
-		if ( output->wl_output == wl_output )
-			update_surface(output);
+	stats.focused_output_events++;
+	struct Output *output = output_from_wl_output(wl_output);
+	record_event(TRACE_FOCUSED_OUTPUT, output == NULL ? 0 : output->global_name, NULL, 0);
+	flight_record(&flight, FLIGHT_FOCUSED_OUTPUT, output == NULL ? 0 : output->global_name, 0, 0);
+	if ( output != NULL )
+		request_update(output);
+}
+
+static void river_seat_status_handle_unfocused_output (void *data, struct zriver_seat_status_v1 *seat_status,
+		struct wl_output *wl_output)
+{
+	// TODO might be needed, especially for multi-seat
+	struct Output *output = output_from_wl_output(wl_output);
+	record_event(TRACE_UNFOCUSED_OUTPUT, output == NULL ? 0 : output->global_name, NULL, 0);
+	flight_record(&flight, FLIGHT_UNFOCUSED_OUTPUT, output == NULL ? 0 : output->global_name, 0, 0);
+}
+
+static void river_seat_status_handle_focused_view (void *data, struct zriver_seat_status_v1 *seat_status,
+		const char *title)
+{
+	record_event(TRACE_FOCUSED_VIEW, 0, title, strlen(title));
 }
 
-static void noop ( ) { }
 static const struct zriver_seat_status_v1_listener river_seat_status_listener = {
 	.focused_output   = river_seat_status_handle_focused_output,
-	.unfocused_output = noop, // TODO might be needed, especially for multi-seat
-	.focused_view     = noop,
+	.unfocused_output = river_seat_status_handle_unfocused_output,
+	.focused_view     = river_seat_status_handle_focused_view,
 };
 
 static struct Seat *seat_from_global_name (uint32_t name)
@@ -622,23 +2154,189 @@ static struct Seat *seat_from_global_name (uint32_t name)
 	return NULL;
 }
 
-static void destroy_seat (struct Seat *seat)
+static void destroy_seat (struct Seat *seat)
+{
+	if ( seat->river_status != NULL )
+		zriver_seat_status_v1_destroy(seat->river_status);
+	wl_seat_destroy(seat->wl_seat);
+	wl_list_remove(&seat->link);
+	free(seat);
+}
+
+
+static void configure_seat (struct Seat *seat)
+{
+	seat->river_status = zriver_status_manager_v1_get_river_seat_status(
+			river_status_manager, seat->wl_seat);
+	zriver_seat_status_v1_add_listener(seat->river_status,
+			&river_seat_status_listener, seat);
+	seat->configured = true;
+}
+
+/**************
+ *            *
+ *  Headless  *
+ *            *
+ **************/
+/* Renderers of --render-to: the span renderer of the pop-ups, the pixman
+ * atlas renderer and the plain reference renderer both are checked against.
+ */
+enum Renderer
+{
+	RENDERER_SPANS,
+	RENDERER_PIXMAN,
+	RENDERER_REFERENCE,
+};
+
+/* Writes the image as binary PPM, or as PAM with an alpha channel if the
+ * path ends in ".pam". Colours stay premultiplied, like in the buffers.
+ */
+static bool write_image (pixman_image_t *image, const char *path)
+{
+	const size_t length = strlen(path);
+	const bool alpha = length >= 4 && strcmp(path + length - 4, ".pam") == 0;
+	const int width = pixman_image_get_width(image);
+	const int height = pixman_image_get_height(image);
+	const pixman_format_code_t format = pixman_image_get_format(image);
+
+	FILE *file = fopen(path, "w");
+	if ( file == NULL )
+	{
+		fprintf(stderr, "ERROR: fopen: %s: %s.\n", path, strerror(errno));
+		return false;
+	}
+
+	if (alpha)
+		fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+				width, height);
+	else
+		fprintf(file, "P6\n%d %d\n255\n", width, height);
+
+	const uint8_t *data = (uint8_t *)pixman_image_get_data(image);
+	const size_t stride = (size_t)pixman_image_get_stride(image);
+	for (int y = 0; y < height; y++)
+	{
+		const uint8_t *row = data + (size_t)y * stride;
+		for (int x = 0; x < width; x++)
+		{
+			uint32_t pixel;
+			if ( format == PIXMAN_r5g6b5 )
+			{
+				/* Expanded to 8 bits per channel like pixman does. */
+				const uint32_t p = ((const uint16_t *)row)[x];
+				const uint32_t r = (p >> 11) & 0x1f, g = (p >> 5) & 0x3f, b = p & 0x1f;
+				pixel = 0xff000000 | (((r << 3) | (r >> 2)) << 16)
+					| (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+			}
+			else
+			{
+				pixel = ((const uint32_t *)row)[x];
+				if ( format == PIXMAN_x8r8g8b8 )
+					pixel |= 0xff000000;
+			}
+
+			const uint8_t bytes[4] = {
+				(uint8_t)(pixel >> 16), (uint8_t)(pixel >> 8),
+				(uint8_t)pixel, (uint8_t)(pixel >> 24),
+			};
+			fwrite(bytes, 1, alpha ? 4 : 3, file);
+		}
+	}
+
+	if ( ferror(file) || fclose(file) == EOF )
+	{
+		fprintf(stderr, "ERROR: Can not write %s.\n", path);
+		return false;
+	}
+	return true;
+}
+
+/* Draws the pop-up for the tags into an image like the buffers of
+ * render_frame() and writes it to the path, without connecting to the
+ * compositor. If from is not NULL, its tags are drawn first and the frame
+ * is drawn as an update of them, to check partial redraws; the reference
+ * renderer always draws whole frames.
+ */
+static bool render_to_file (const char *path, uint32_t scale, struct Tags *tags,
+		struct Tags *from, enum Renderer renderer)
 {
-	if ( seat->river_status != NULL )
-		zriver_seat_status_v1_destroy(seat->river_status);
-	wl_seat_destroy(seat->wl_seat);
-	wl_list_remove(&seat->link);
-	free(seat);
-}
+	if ( buffer_format == NULL )
+		buffer_format = colours_opaque()
+			? &formats[FORMAT_XRGB8888] : &formats[FORMAT_ARGB8888];
+	else if ( buffer_format->opaque && ! colours_opaque() )
+	{
+		fprintf(stderr, "ERROR: Can not use the %s format, it can not draw translucent colours.\n",
+				buffer_format->name);
+		return false;
+	}
 
+	const uint32_t width = scale_length(surface_width, scale);
+	const uint32_t height = scale_length(surface_height, scale);
+	pixman_image_t *image = pixman_image_create_bits(buffer_format->pixman_format,
+			(int32_t)width, (int32_t)height, NULL, 0);
+	if ( image == NULL )
+	{
+		fputs("ERROR: Can not create image.\n", stderr);
+		return false;
+	}
 
-static void configure_seat (struct Seat *seat)
+	wl_list_init(&atlases);
+	wl_list_init(&layouts);
+
+	bool ret;
+	if ( renderer == RENDERER_REFERENCE )
+	{
+		ret = prepare_labels(scale);
+		if ( ret && from != NULL )
+			ret = draw_frame_reference(image, scale, from);
+		if (ret)
+			ret = draw_frame_reference(image, scale, tags);
+	}
+	else if ( renderer == RENDERER_PIXMAN )
+	{
+		struct Atlas *atlas = get_atlas(scale);
+		ret = atlas != NULL && prepare_labels(scale);
+		if ( ret && from != NULL )
+			ret = draw_frame_pixman(image, atlas, from, NULL);
+		if (ret)
+			ret = draw_frame_pixman(image, atlas, tags, from);
+	}
+	else
+	{
+		ret = prepare_frame(width, height, scale);
+		if ( ret && from != NULL )
+			ret = draw_frame(image, scale, from, NULL);
+		if (ret)
+			ret = draw_frame(image, scale, tags, from);
+	}
+
+	if (! ret)
+		fputs("ERROR: Can not draw frame.\n", stderr);
+	else
+		ret = write_image(image, path);
+
+	pixman_image_unref(image);
+	destroy_atlases();
+	destroy_layouts();
+	return ret;
+}
+
+static bool parse_tags (struct Tags *tags, const char *str)
 {
-	seat->river_status = zriver_status_manager_v1_get_river_seat_status(
-			river_status_manager, seat->wl_seat);
-	zriver_seat_status_v1_add_listener(seat->river_status,
-			&river_seat_status_listener, seat);
-	seat->configured = true;
+	long focused, view, urgent;
+	if ( 3 != sscanf(str, "%li:%li:%li", &focused, &view, &urgent)
+			|| focused < 0 || focused > UINT32_MAX
+			|| view < 0 || view > UINT32_MAX
+			|| urgent < 0 || urgent > UINT32_MAX )
+	{
+		fprintf(stderr, "ERROR: Invalid tags: %s\n", str);
+		return false;
+	}
+
+	tags->focused = (uint32_t)focused;
+	tags->view = (uint32_t)view;
+	tags->urgent = (uint32_t)urgent;
+	return true;
 }
 
 /**********
@@ -646,6 +2344,17 @@ static void configure_seat (struct Seat *seat)
  *  Main  *
  *        *
  **********/
+static void shm_handle_format (void *data, struct wl_shm *wl_shm, uint32_t format)
+{
+	for (size_t i = 0; i < FORMAT_AMOUNT; i++)
+		if ( formats[i].shm_format == format )
+			formats[i].advertised = true;
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = shm_handle_format,
+};
+
 static void registry_handle_global (void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version)
 {
@@ -661,9 +2370,11 @@ static void registry_handle_global (void *data, struct wl_registry *registry,
 		output->wl_output = wl_registry_bind(registry, name, &wl_output_interface, 3);
 		output->global_name = name;
 		output->surface = NULL;
-		wl_output_set_user_data(output->wl_output, output);
-		wl_list_insert(&outputs, &output->link);
 		output->scale = 1;
+		output->hide_index = HIDE_NONE;
+		wl_output_add_listener(output->wl_output, &output_listener, output);
+		wl_list_insert(&outputs, &output->link);
+		record_event(TRACE_OUTPUT_ADD, name, NULL, 0);
 
 		if ( river_status_manager != NULL )
 			configure_output(output);
@@ -691,7 +2402,23 @@ static void registry_handle_global (void *data, struct wl_registry *registry,
 	else if ( strcmp(interface, wl_compositor_interface.name) == 0 )
 		wl_compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
 	else if ( strcmp(interface, wl_shm_interface.name) == 0 )
+	{
 		wl_shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+		wl_shm_add_listener(wl_shm, &shm_listener, NULL);
+	}
+	else if ( strcmp(interface, wl_subcompositor_interface.name) == 0 )
+		wl_subcompositor = wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
+	else if ( strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name) == 0 )
+		single_pixel_buffer_manager = wl_registry_bind(registry, name,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
+	else if ( strcmp(interface, wp_viewporter_interface.name) == 0 )
+		viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+	else if ( strcmp(interface, wp_alpha_modifier_v1_interface.name) == 0 )
+		alpha_modifier_manager = wl_registry_bind(registry, name,
+				&wp_alpha_modifier_v1_interface, 1);
+	else if ( strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0 )
+		fractional_scale_manager = wl_registry_bind(registry, name,
+				&wp_fractional_scale_manager_v1_interface, 1);
 }
 
 static void registry_handle_global_remove (void *data, struct wl_registry *registry, uint32_t name)
@@ -699,6 +2426,7 @@ static void registry_handle_global_remove (void *data, struct wl_registry *regis
 	struct Output *output = output_from_global_name(name);
 	if ( output != NULL )
 	{
+		record_event(TRACE_OUTPUT_REMOVE, name, NULL, 0);
 		destroy_output(output);
 		return;
 	}
@@ -729,6 +2457,26 @@ static char *check_for_interfaces (void)
 	return NULL;
 }
 
+static void sync_handle_done (void *data, struct wl_callback *wl_callback, uint32_t other);
+
+static const struct wl_callback_listener sync_callback_listener = {
+	.done = sync_handle_done,
+};
+
+/* Returns why shm buffers can not use the format, or NULL if they can. */
+static const char *format_unsupported (struct Format *format)
+{
+	if (! format->advertised)
+		return "the compositor does not support it";
+	if (! format->opaque)
+		return NULL;
+	if ( fade_duration > 0 && alpha_modifier_manager == NULL )
+		return "fading out needs wp_alpha_modifier_v1 with it";
+	if (! colours_opaque())
+		return "it can not draw translucent colours";
+	return NULL;
+}
+
 static void sync_handle_done (void *data, struct wl_callback *wl_callback, uint32_t other)
 {
 	wl_callback_destroy(wl_callback);
@@ -743,49 +2491,58 @@ static void sync_handle_done (void *data, struct wl_callback *wl_callback, uint3
 		return;
 	}
 
-	struct Output *output;
-	wl_list_for_each(output, &outputs, link)
-		if (! output->configured)
-			configure_output(output);
-
-	struct Seat *seat;
-	wl_list_for_each(seat, &seats, link)
-		if (! seat->configured)
-			configure_seat(seat);
-}
-
-static const struct wl_callback_listener sync_callback_listener = {
-	.done = sync_handle_done,
-};
+	/* wl_shm sends its formats when bound, which happens in reply to
+	 * the first sync; a second one waits for them.
+	 */
+	if (! shm_formats_synced)
+	{
+		shm_formats_synced = true;
+		sync_callback = wl_display_sync(wl_display);
+		wl_callback_add_listener(sync_callback, &sync_callback_listener, NULL);
+		return;
+	}
 
-static void timespec_diff (struct timespec *a, struct timespec *b, struct timespec *result)
-{
-	result->tv_sec  = a->tv_sec  - b->tv_sec;
-	result->tv_nsec = a->tv_nsec - b->tv_nsec;
-	if ( result->tv_nsec < 0 )
+	if ( buffer_format != NULL && format_unsupported(buffer_format) != NULL )
 	{
-		result->tv_sec--;
-		result->tv_nsec += 1000000000L;
+		fprintf(stderr, "ERROR: Can not use the %s format, %s.\n",
+				buffer_format->name, format_unsupported(buffer_format));
+		loop = false;
+		ret = EXIT_FAILURE;
+		return;
 	}
-}
 
-static bool colour_from_hex (pixman_color_t *colour, const char *hex)
-{
-	uint16_t r = 0, g = 0, b = 0, a = 255;
+	/* ARGB8888 is the fallback, as every compositor supports it. RGB565
+	 * loses colour depth, so it is only used when asked for.
+	 */
+	if ( buffer_format == NULL )
+		buffer_format = format_unsupported(&formats[FORMAT_XRGB8888]) == NULL
+			? &formats[FORMAT_XRGB8888] : &formats[FORMAT_ARGB8888];
 
-	if ( 4 != sscanf(hex, "0x%02hx%02hx%02hx%02hx", &r, &g, &b, &a)
-			&& 3 != sscanf(hex, "0x%02hx%02hx%02hx", &r, &g, &b) )
+	/* Decided before any status objects exist, so before the first
+	 * pop-up is created.
+	 */
+	const char *problem = scene_unsupported();
+	if ( backend == BACKEND_SUBSURFACE && problem != NULL )
 	{
-		fprintf(stderr, "ERROR: Invalid colour: %s\n", hex);
-		return false;
+		fprintf(stderr, "ERROR: Can not use the subsurface backend, %s.\n", problem);
+		loop = false;
+		ret = EXIT_FAILURE;
+		return;
 	}
+	if ( backend == BACKEND_AUTO )
+		backend = problem == NULL ? BACKEND_SUBSURFACE : BACKEND_SHM;
+	if ( backend == BACKEND_SUBSURFACE && ! init_colour_buffers() )
+		backend = BACKEND_SHM;
 
-	colour->alpha = (uint16_t)(((double)a / 255.0) * 65535.0);
-	colour->red   = (uint16_t)((((double)r / 255.0) * 65535.0) * colour->alpha / 0xffff);
-	colour->green = (uint16_t)((((double)g / 255.0) * 65535.0) * colour->alpha / 0xffff);
-	colour->blue  = (uint16_t)((((double)b / 255.0) * 65535.0) * colour->alpha / 0xffff);
+	struct Output *output;
+	wl_list_for_each(output, &outputs, link)
+		if (! output->configured)
+			configure_output(output);
 
-	return true;
+	struct Seat *seat;
+	wl_list_for_each(seat, &seats, link)
+		if (! seat->configured)
+			configure_seat(seat);
 }
 
 static bool parse_anchors (const char *str)
@@ -821,23 +2578,106 @@ static bool parse_margins (const char *str)
 	return true;
 }
 
-int main (int argc, char *argv[])
+static void write_stats (void)
 {
-	/* Default colours.*/
-	colour_from_hex(&background_colour, "0x666666");
-	colour_from_hex(&border_colour, "0x333333");
+	FILE *file = stderr;
+	if ( stats_path != NULL )
+	{
+		file = fopen(stats_path, "w");
+		if ( file == NULL )
+		{
+			fprintf(stderr, "ERROR: fopen: %s: %s.\n", stats_path, strerror(errno));
+			return;
+		}
+	}
+
+	fprintf(file, "{\"events\":{\"focused_tags\":%lu,\"view_tags\":%lu,\"urgent_tags\":%lu,"
+			"\"focused_output\":%lu},\"renders\":%lu,\"renders_shared\":%lu,\"commits\":%lu,\"buffers_created\":%lu,"
+			"\"surfaces_created\":%lu,\"surfaces_destroyed\":%lu,\"wakeups\":%lu,"
+			"\"buffers_exhausted\":%lu,\"buffer_ring_grown\":%lu,\"frames_dropped\":%lu,"
+			"\"fade_frames\":%lu,\"fade_cpu_ns\":%lu,\"latency_ns\":",
+			(unsigned long)stats.focused_tags_events, (unsigned long)stats.view_tags_events,
+			(unsigned long)stats.urgent_tags_events, (unsigned long)stats.focused_output_events,
+			(unsigned long)stats.renders, (unsigned long)stats.renders_shared,
+			(unsigned long)stats.commits,
+			(unsigned long)stats.buffers_created, (unsigned long)stats.surfaces_created,
+			(unsigned long)stats.surfaces_destroyed, (unsigned long)stats.wakeups,
+			(unsigned long)stats.buffers_exhausted, (unsigned long)stats.buffer_ring_grown,
+			(unsigned long)stats.frames_dropped, (unsigned long)stats.fade_frames,
+			(unsigned long)stats.fade_cpu_nsec);
+	histogram_write_json(&stats.latency, file);
+	fputs("}\n", file);
+
+	if ( file != stderr )
+		fclose(file);
+}
+
+static void write_flight (void)
+{
+	FILE *file = stderr;
+	if ( flight_path != NULL )
+	{
+		file = fopen(flight_path, "w");
+		if ( file == NULL )
+		{
+			fprintf(stderr, "ERROR: fopen: %s: %s.\n", flight_path, strerror(errno));
+			return;
+		}
+	}
+
+	flight_write_json(&flight, file, getpid());
+
+	if ( file != stderr )
+		fclose(file);
+}
+
+/* Signals are blocked and read from a signalfd in the main loop, so their
+ * handling is free to do anything.
+ */
+static int create_signal_fd (void)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	if ( sigprocmask(SIG_BLOCK, &mask, NULL) == -1 )
+	{
+		fprintf(stderr, "ERROR: sigprocmask: %s.\n", strerror(errno));
+		return -1;
+	}
+
+	const int fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if ( fd == -1 )
+		fprintf(stderr, "ERROR: signalfd: %s.\n", strerror(errno));
+	return fd;
+}
+
+static void handle_signals (int fd)
+{
+	struct signalfd_siginfo info;
+	while ( read(fd, &info, sizeof(info)) == sizeof(info) ) switch (info.ssi_signo)
+	{
+		case SIGUSR1:
+			write_stats();
+			break;
 
-	colour_from_hex(&active_square_background_colour, "0xE6803A");
-	colour_from_hex(&active_square_border_colour, "0xB24C21");
-	colour_from_hex(&active_square_occupied_colour, "0xFFB277");
+		case SIGUSR2:
+			write_flight();
+			break;
 
-	colour_from_hex(&inactive_square_background_colour, "0x999999");
-	colour_from_hex(&inactive_square_border_colour, "0x7F7F7F");
-	colour_from_hex(&inactive_square_occupied_colour, "0xCCCCCC");
+		case SIGINT:
+		case SIGTERM:
+			loop = false;
+			break;
+	}
+}
 
-	colour_from_hex(&urgent_square_background_colour, "0xEA2113");
-	colour_from_hex(&urgent_square_border_colour, "0xC11414");
-	colour_from_hex(&urgent_square_occupied_colour, "0xFF6B56");
+int main (int argc, char *argv[])
+{
+	/* Default colours.*/
+	default_colours();
 
 	enum
 	{
@@ -860,6 +2700,22 @@ int main (int argc, char *argv[])
 		SQUARE_URGENT_OCCUPIED_COLOUR,
 		ANCHORS,
 		MARGINS,
+		FADE_DURATION,
+		BUFFERS,
+		STATS_FILE,
+		FLIGHT_FILE,
+		RECORD,
+		BACKEND,
+		FORMAT,
+		TAG_LABELS,
+		FONT,
+		RENDER_THREADS,
+		SPAN_KERNEL,
+		RENDER_TO,
+		RENDER_TAGS,
+		RENDER_FROM,
+		RENDER_SCALE,
+		RENDERER,
 	};
 
 	static struct option opts[] = {
@@ -883,9 +2739,34 @@ int main (int argc, char *argv[])
 		{ "square-urgent-occupied-colour",     required_argument, NULL, SQUARE_URGENT_OCCUPIED_COLOUR     },
 		{ "anchors",                           required_argument, NULL, ANCHORS                           },
 		{ "margins",                           required_argument, NULL, MARGINS                           },
+		{ "fade-duration",                     required_argument, NULL, FADE_DURATION                     },
+		{ "buffers",                           required_argument, NULL, BUFFERS                           },
+		{ "stats-file",                        required_argument, NULL, STATS_FILE                        },
+		{ "flight-file",                       required_argument, NULL, FLIGHT_FILE                       },
+		{ "record",                            required_argument, NULL, RECORD                            },
+		{ "backend",                           required_argument, NULL, BACKEND                           },
+		{ "format",                            required_argument, NULL, FORMAT                            },
+		{ "tag-labels",                        required_argument, NULL, TAG_LABELS                        },
+		{ "font",                              required_argument, NULL, FONT                              },
+		{ "render-threads",                    required_argument, NULL, RENDER_THREADS                    },
+		{ "span-kernel",                       required_argument, NULL, SPAN_KERNEL                       },
+		{ "render-to",                         required_argument, NULL, RENDER_TO                         },
+		{ "render-tags",                       required_argument, NULL, RENDER_TAGS                       },
+		{ "render-from",                       required_argument, NULL, RENDER_FROM                       },
+		{ "render-scale",                      required_argument, NULL, RENDER_SCALE                      },
+		{ "renderer",                          required_argument, NULL, RENDERER                          },
 		{ NULL,                                0,                 NULL, 0                                 },
 	};
 
+	const char *record_path = NULL;
+	const char *font_name = "monospace:bold";
+	const char *render_path = NULL;
+	struct Tags render_tags = { .focused = 1, .view = 1 };
+	struct Tags render_from;
+	bool render_update = false;
+	uint32_t render_scale_120 = 120;
+	enum Renderer renderer = RENDERER_SPANS;
+
 	int opt;
 	int32_t tmp;
 	while ( (opt = getopt_long(argc, argv, "h", opts, NULL)) != -1 ) switch (opt)
@@ -1019,6 +2900,132 @@ int main (int argc, char *argv[])
 				return EXIT_FAILURE;
 			break;
 
+		case FADE_DURATION:
+			tmp = atoi(optarg);
+			if ( tmp < 0 )
+			{
+				fputs("ERROR: Fade duration may not be smaller than 0.\n", stderr);
+				return EXIT_FAILURE;
+			}
+			fade_duration = (uint64_t)tmp * 1000000;
+			break;
+
+		case BUFFERS:
+			tmp = atoi(optarg);
+			if ( tmp < 1 || tmp > BUFFER_MAX )
+			{
+				fputs("ERROR: Can only use between 1 and 3 buffers.\n", stderr);
+				return EXIT_FAILURE;
+			}
+			buffer_amount = (uint32_t)tmp;
+			break;
+
+		case STATS_FILE:
+			stats_path = optarg;
+			break;
+
+		case FLIGHT_FILE:
+			flight_path = optarg;
+			break;
+
+		case RECORD:
+			record_path = optarg;
+			break;
+
+		case BACKEND:
+			if ( strcmp(optarg, "auto") == 0 )
+				backend = BACKEND_AUTO;
+			else if ( strcmp(optarg, "shm") == 0 )
+				backend = BACKEND_SHM;
+			else if ( strcmp(optarg, "subsurface") == 0 )
+				backend = BACKEND_SUBSURFACE;
+			else
+			{
+				fprintf(stderr, "ERROR: Unknown backend: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case FORMAT:
+			buffer_format = NULL;
+			for (size_t i = 0; i < FORMAT_AMOUNT; i++)
+				if ( strcmp(optarg, formats[i].name) == 0 )
+					buffer_format = &formats[i];
+			if ( buffer_format == NULL && strcmp(optarg, "auto") != 0 )
+			{
+				fprintf(stderr, "ERROR: Unknown format: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case TAG_LABELS:
+			if (! parse_tag_labels(optarg))
+				return EXIT_FAILURE;
+			break;
+
+		case FONT:
+			font_name = optarg;
+			break;
+
+		case RENDER_THREADS:
+			tmp = strcmp(optarg, "auto") == 0 ? 0 : atoi(optarg);
+			if ( tmp < 0 || tmp > 64 || ( tmp == 0 && strcmp(optarg, "auto") != 0 ) )
+			{
+				fputs("ERROR: Can only use auto or between 1 and 64 render threads.\n", stderr);
+				return EXIT_FAILURE;
+			}
+			render_threads = (uint32_t)tmp;
+			break;
+
+		case SPAN_KERNEL:
+			if (! select_span_kernel(optarg))
+			{
+				fprintf(stderr, "ERROR: Span kernel '%s' is not available.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case RENDER_TO:
+			render_path = optarg;
+			break;
+
+		case RENDER_TAGS:
+			if (! parse_tags(&render_tags, optarg))
+				return EXIT_FAILURE;
+			break;
+
+		case RENDER_FROM:
+			if (! parse_tags(&render_from, optarg))
+				return EXIT_FAILURE;
+			render_update = true;
+			break;
+
+		case RENDER_SCALE:
+		{
+			const double scale = atof(optarg);
+			if ( scale < 0.5 || scale > 10.0 )
+			{
+				fputs("ERROR: Render scale must be between 0.5 and 10.\n", stderr);
+				return EXIT_FAILURE;
+			}
+			render_scale_120 = (uint32_t)(scale * 120.0 + 0.5);
+			break;
+		}
+
+		case RENDERER:
+			if ( strcmp(optarg, "spans") == 0 )
+				renderer = RENDERER_SPANS;
+			else if ( strcmp(optarg, "pixman") == 0 )
+				renderer = RENDERER_PIXMAN;
+			else if ( strcmp(optarg, "reference") == 0 )
+				renderer = RENDERER_REFERENCE;
+			else
+			{
+				fprintf(stderr, "ERROR: Unknown renderer: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
 		default:
 			return EXIT_FAILURE;
 	}
@@ -1029,8 +3036,25 @@ int main (int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	surface_width = (tag_amount * (square_size + square_padding)) + square_padding + (2 * border_width);
-	surface_height = square_size + (2 * square_padding) + (2 * border_width);
+	compute_surface_size();
+
+	/* Fonts are looked up once, before anything is drawn. */
+	wl_list_init(&label_atlases);
+	if ( tag_label_amount > 0 && ! load_font(font_name) )
+	{
+		finish_font();
+		return EXIT_FAILURE;
+	}
+
+	if ( render_path != NULL )
+	{
+		ret = render_to_file(render_path, render_scale_120, &render_tags,
+				render_update ? &render_from : NULL, renderer)
+			? EXIT_SUCCESS : EXIT_FAILURE;
+		destroy_label_atlases();
+		finish_font();
+		return ret;
+	}
 
 	/* We query the display name here instead of letting wl_display_connect()
 	 * figure it out itself, because libwayland (for legacy reasons) falls
@@ -1053,6 +3077,22 @@ int main (int argc, char *argv[])
 
 	wl_list_init(&outputs);
 	wl_list_init(&seats);
+	wl_list_init(&buffers);
+	wl_list_init(&layouts);
+
+	if ( record_path != NULL && ! start_recording(record_path) )
+	{
+		wl_display_disconnect(wl_display);
+		return EXIT_FAILURE;
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if ( timer_fd == -1 )
+	{
+		fprintf(stderr, "ERROR: timerfd_create: %s.\n", strerror(errno));
+		wl_display_disconnect(wl_display);
+		return EXIT_FAILURE;
+	}
 
 	wl_registry = wl_display_get_registry(wl_display);
 	wl_registry_add_listener(wl_registry, &registry_listener, NULL);
@@ -1060,56 +3100,75 @@ int main (int argc, char *argv[])
 	sync_callback = wl_display_sync(wl_display);
 	wl_callback_add_listener(sync_callback, &sync_callback_listener, NULL);
 
+	const int signal_fd = create_signal_fd();
+	if ( signal_fd == -1 )
+	{
+		close(timer_fd);
+		wl_display_disconnect(wl_display);
+		return EXIT_FAILURE;
+	}
+	start_workers();
+
 	struct pollfd pollfds[] = {
 		{
 			.fd = wl_display_get_fd(wl_display),
 			.events = POLLIN,
 		},
+		{
+			.fd = timer_fd,
+			.events = POLLIN,
+		},
+		{
+			.fd = signal_fd,
+			.events = POLLIN,
+		},
 	};
 
 	while (loop)
 	{
-		int timeout = -1;
-		struct Output *output;
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		wl_list_for_each(output, &outputs, link)
+		/* Events already in the queue are dispatched before reading, as
+		 * poll() would not wake up for them.
+		 */
+		bool error = false;
+		while ( wl_display_prepare_read(wl_display) != 0 )
 		{
-			if ( output->surface == NULL )
-				continue;
-			if (! output->surface->configured)
-				continue;
-
-			const long nsec_half_second = 500000000;
-			const long epsilon = 1000000;
- 			struct timespec time_since_last_frame;
-			timespec_diff(&now, &output->surface->last_frame, &time_since_last_frame);
-			if ( time_since_last_frame.tv_sec > 0 || time_since_last_frame.tv_nsec >= nsec_half_second - epsilon )
+			if ( wl_display_dispatch_pending(wl_display) == -1 )
 			{
-				destroy_surface(output->surface);
-				output->surface = NULL;
-			}
-			else
-			{
-				const int _timeout = (int)(nsec_half_second - time_since_last_frame.tv_nsec) / 1000000;
-				if ( timeout == -1 || timeout > _timeout )
-					timeout = _timeout;
+				error = true;
+				break;
 			}
+			update_outputs();
+		}
+		if (error)
+		{
+			fprintf(stderr, "ERROR: wl_display_dispatch_pending: %s.\n", strerror(errno));
+			ret = EXIT_FAILURE;
+			break;
 		}
 
-		/* Flush wayland events. */
-		do
+		/* If the socket is full, the rest is flushed once it has room
+		 * again, instead of retrying right away.
+		 */
+		pollfds[0].events = POLLIN;
+		if ( wl_display_flush(wl_display) == -1 )
 		{
-			if ( wl_display_flush(wl_display) == -1 && errno != EAGAIN)
+			if ( errno != EAGAIN )
 			{
 				fprintf(stderr, "ERROR: wl_display_flush: %s.\n", strerror(errno));
+				wl_display_cancel_read(wl_display);
+				ret = EXIT_FAILURE;
 				break;
 			}
-		} while ( errno == EAGAIN );
-
+			pollfds[0].events |= POLLOUT;
+		}
 
-		if ( poll(pollfds, 1, timeout) < 0 )
+		flight_record(&flight, FLIGHT_POLL_BEGIN, 0, 0, 0);
+		const int poll_ret = poll(pollfds, 3, -1);
+		flight_record(&flight, FLIGHT_POLL_END, 0, 0, 0);
+		stats.wakeups++;
+		if ( poll_ret < 0 )
 		{
+			wl_display_cancel_read(wl_display);
 			if ( errno == EINTR )
 				continue;
 			fprintf(stderr, "ERROR: poll: %s.\n", strerror(errno));
@@ -1117,30 +3176,89 @@ int main (int argc, char *argv[])
 			break;
 		}
 
-		if ( (pollfds[0].revents & POLLIN) && wl_display_dispatch(wl_display) == -1 )
+		if ( pollfds[0].revents & (POLLIN | POLLERR | POLLHUP) )
 		{
-			fprintf(stderr, "ERROR: wl_display_dispatch: %s.\n", strerror(errno));
-			break;
+			if ( wl_display_read_events(wl_display) == -1 )
+			{
+				fprintf(stderr, "ERROR: wl_display_read_events: %s.\n", strerror(errno));
+				ret = EXIT_FAILURE;
+				break;
+			}
 		}
-		if ( (pollfds[0].revents & POLLOUT) && wl_display_flush(wl_display) == -1 )
+		else
+			wl_display_cancel_read(wl_display);
+
+		if ( wl_display_dispatch_pending(wl_display) == -1 )
 		{
-			fprintf(stderr, "ERROR: wl_display_flush: %s.\n", strerror(errno));
+			fprintf(stderr, "ERROR: wl_display_dispatch_pending: %s.\n", strerror(errno));
+			ret = EXIT_FAILURE;
 			break;
 		}
+		update_outputs();
+
+		/* Events come in at the pace of the user; flushing the trace
+		 * after every dispatch keeps it complete if we are killed.
+		 */
+		if ( record_file != NULL && fflush(record_file) == EOF )
+		{
+			fprintf(stderr, "ERROR: fflush: %s. Recording stopped.\n", strerror(errno));
+			stop_recording();
+		}
+
+		if ( pollfds[1].revents & POLLIN )
+			handle_hide_timer();
+		if ( pollfds[2].revents & POLLIN )
+			handle_signals(signal_fd);
 	}
 
-	close(pollfds[0].fd);
+	close(signal_fd);
+	close(timer_fd);
+	stop_workers();
 
 	struct Output *output, *otmp;
 	wl_list_for_each_safe(output, otmp, &outputs, link)
 		destroy_output(output);
 
+	struct Buffer *buffer, *btmp;
+	wl_list_for_each_safe(buffer, btmp, &buffers, link)
+		destroy_buffer(buffer);
+	finish_pool(&buffer_pool);
+	destroy_layouts();
+	destroy_label_atlases();
+	finish_font();
+
+	finish_colour_buffers();
+	free(hide_heap);
+	if ( record_file != NULL )
+		stop_recording();
+	if ( fade_mask != NULL )
+		pixman_image_unref(fade_mask);
+
+	if ( stats.fade_frames > 0 )
+		fprintf(stderr, "Fade-out: %lu frames, %.1f us CPU per frame.\n",
+				(unsigned long)stats.fade_frames,
+				(double)stats.fade_cpu_nsec / (double)stats.fade_frames / 1000.0);
+	if ( stats.buffers_exhausted > 0 )
+		fprintf(stderr, "Backpressure: all buffers busy %lu times, ring grown %lu times, %lu frames dropped.\n",
+				(unsigned long)stats.buffers_exhausted, (unsigned long)stats.buffer_ring_grown,
+				(unsigned long)stats.frames_dropped);
+
 	if ( wl_compositor != NULL )
 		wl_compositor_destroy(wl_compositor);
 	if ( wl_shm != NULL )
 		wl_shm_destroy(wl_shm);
+	if ( wl_subcompositor != NULL )
+		wl_subcompositor_destroy(wl_subcompositor);
+	if ( single_pixel_buffer_manager != NULL )
+		wp_single_pixel_buffer_manager_v1_destroy(single_pixel_buffer_manager);
 	if ( layer_shell != NULL )
 		zwlr_layer_shell_v1_destroy(layer_shell);
+	if ( viewporter != NULL )
+		wp_viewporter_destroy(viewporter);
+	if ( fractional_scale_manager != NULL )
+		wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
+	if ( alpha_modifier_manager != NULL )
+		wp_alpha_modifier_v1_destroy(alpha_modifier_manager);
 	if ( river_status_manager != NULL )
 		zriver_status_manager_v1_destroy(river_status_manager);
 	if ( sync_callback != NULL )
@@ -0,0 +1,62 @@
+#ifndef RIVER_TAG_OVERLAY_TRACE_H
+#define RIVER_TAG_OVERLAY_TRACE_H
+
+#include <stdint.h>
+
+/* Trace of the events river-tag-overlay received, written by --record and
+ * replayed by river-tag-overlay-harness --replay. A trace is a header
+ * followed by records, each followed by its payload. Everything is in host
+ * byte order, so traces can only be replayed on machines of the same
+ * endianness.
+ */
+
+/* The first 8 bytes of a trace, without a terminating NUL. */
+#define TRACE_MAGIC "RTOTRACE"
+#define TRACE_VERSION 1
+
+struct Trace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+enum Trace_type
+{
+	/* No payload. */
+	TRACE_OUTPUT_ADD = 1,
+	TRACE_OUTPUT_REMOVE,
+
+	/* Payload is the int32_t scale. */
+	TRACE_OUTPUT_SCALE,
+
+	/* Payload is the uint32_t tags. */
+	TRACE_FOCUSED_TAGS,
+	TRACE_URGENT_TAGS,
+
+	/* Payload is an array of uint32_t tags, one per view. */
+	TRACE_VIEW_TAGS,
+
+	/* No payload; the record refers to the (un)focused output. */
+	TRACE_FOCUSED_OUTPUT,
+	TRACE_UNFOCUSED_OUTPUT,
+
+	/* Payload is the title, without terminating zero. */
+	TRACE_FOCUSED_VIEW,
+};
+
+struct Trace_record
+{
+	/* Nanoseconds since the start of the recording. */
+	uint64_t time;
+
+	/* Global name of the output the event refers to, 0 for none. */
+	uint32_t output;
+
+	uint16_t type;
+
+	/* Length of the payload in bytes. */
+	uint16_t length;
+};
+
+#endif